@@ -0,0 +1,229 @@
+#!/bin/bash
+#
+#   Regression benchmark for swingline: runs a fixed matrix of images,
+#   sample counts and iteration counts through the headless path, and
+#   compares per-stage timings and stippling quality against a baseline.
+#
+#   Usage: bench/bench.sh            run, and compare with the baseline
+#          bench/bench.sh baseline   run, and save the results as the
+#                                    new baseline
+#
+#   For each image and sample count, --bench gives the median time of
+#   each stage.  For each iteration count, a normal run gives the mean
+#   displacement at its last convergence check, then the CPU engine
+#   takes one more step from its points: how far that step moves them is
+#   their distance from the true weighted centroids of their cells.
+#
+#   Settings come from the environment:
+#     SWINGLINE          binary to test (default: ./swingline)
+#     BENCH_DIR          scratch directory (default: bench/out)
+#     BENCH_BASELINE     baseline results (default: bench/baseline.tsv)
+#     BENCH_SIZE         side of the synthetic images (default: 1024)
+#     BENCH_IMAGES       extra images (e.g. photographs) to include
+#     BENCH_SAMPLES      sample counts (default: 1000 10000 60000)
+#     BENCH_ITERATIONS   iteration counts (default: 50 200)
+#     BENCH_TIMED        iterations timed with --bench (default: 50)
+#     BENCH_FLAGS        extra options for the GPU runs, e.g. to pick an
+#                        engine; options that change the density (such
+#                        as --gamma) would also need the CPU reference
+#                        changed, so aren't supported
+#     BENCH_SLOWER       percent slowdown allowed (default: 10)
+#     BENCH_WORSE        percent growth in centroid error allowed, over
+#                        a floor of 0.005 px (default: 10)
+
+set -o pipefail
+
+SWINGLINE=${SWINGLINE:-./swingline}
+BENCH_DIR=${BENCH_DIR:-bench/out}
+BENCH_BASELINE=${BENCH_BASELINE:-bench/baseline.tsv}
+BENCH_SIZE=${BENCH_SIZE:-1024}
+BENCH_SAMPLES=${BENCH_SAMPLES:-1000 10000 60000}
+BENCH_ITERATIONS=${BENCH_ITERATIONS:-50 200}
+BENCH_TIMED=${BENCH_TIMED:-50}
+BENCH_SLOWER=${BENCH_SLOWER:-10}
+BENCH_WORSE=${BENCH_WORSE:-10}
+
+export LC_ALL=C
+
+if [ ! -x "$SWINGLINE" ]; then
+    echo "Error: $SWINGLINE not found (run make first)" >&2
+    exit 1
+fi
+mkdir -p "$BENCH_DIR/images" || exit 1
+
+#   Writes a BENCH_SIZE square 8-bit PGM of the named pattern to $2
+synthetic()
+{
+    awk -v pattern="$1" -v size="$BENCH_SIZE" 'BEGIN {
+        printf "P5\n%d %d\n255\n", size, size
+        c = (size - 1) / 2
+        for (y = 0; y < size; ++y) {
+            for (x = 0; x < size; ++x) {
+                r = sqrt((x - c) * (x - c) + (y - c) * (y - c))
+                if (pattern == "ramp") {
+                    v = 255 * x / (size - 1)        # smooth density
+                } else if (pattern == "disc") {
+                    v = 255 * r / c                 # dark centre
+                } else if (pattern == "rings") {
+                    v = 127.5 + 127.5 * cos(r / 5)  # fine detail
+                } else {
+                    n = int(x * 8 / size) + int(y * 8 / size)
+                    v = (n % 2) ? 240 : 16          # hard edges
+                }
+                printf "%c", (v > 255) ? 255 : int(v)
+            }
+        }
+    }' > "$2"
+}
+
+IMAGES=""
+for pattern in ramp disc rings checker; do
+    image="$BENCH_DIR/images/$pattern-$BENCH_SIZE.pgm"
+    if [ ! -s "$image" ]; then
+        synthetic "$pattern" "$image" || exit 1
+    fi
+    IMAGES="$IMAGES $image"
+done
+IMAGES="$IMAGES $BENCH_IMAGES"
+
+#   Prints the named columns of the last row of CSV on stdin
+csv_columns()
+{
+    awk -F, -v names="$*" '
+        NR == 1 { for (i = 1; i <= NF; ++i) col[$i] = i; next }
+        { row = $0 }
+        END {
+            n = split(names, want, " ")
+            split(row, f, ",")
+            for (i = 1; i <= n; ++i) {
+                printf "%s%s", (i > 1) ? "\t" : "",
+                       (want[i] in col) ? f[col[want[i]]] : "-"
+            }
+            printf "\n"
+        }'
+}
+
+#   Prints the named fields of the last "stats" line of --metrics output
+stats_fields()
+{
+    awk -v names="$*" '
+        /"type": "stats"/ { line = $0 }
+        END {
+            n = split(names, want, " ")
+            for (i = 1; i <= n; ++i) {
+                v = "-"
+                key = "\"" want[i] "\": "
+                if ((p = index(line, key))) {
+                    v = substr(line, p + length(key))
+                    sub(/[,}].*/, "", v)
+                }
+                printf "%s%s", (i > 1) ? "\t" : "", v
+            }
+            printf "\n"
+        }'
+}
+
+RESULTS="$BENCH_DIR/results.tsv"
+printf "case\tvoronoi_ms\tsum_ms\tfeedback_ms\ttotal_ms\tdisplacement_px" \
+    > "$RESULTS"
+printf "\tcentroid_err_px\tcentroid_max_px\n" >> "$RESULTS"
+
+failed=0
+for image in $IMAGES; do
+    name=$(basename "${image%.*}")
+    for samples in $BENCH_SAMPLES; do
+        timings=$("$SWINGLINE" "$image" -n "$samples" $BENCH_FLAGS \
+                  --bench "$BENCH_TIMED" --bench-format csv 2>/dev/null |
+                  csv_columns voronoi_median_ms sum_median_ms \
+                              feedback_median_ms total_median_ms)
+        if [ $? -ne 0 ]; then
+            echo "Error: --bench failed on $image with -n $samples" >&2
+            timings=$'-\t-\t-\t-'
+            failed=1
+        fi
+
+        for iterations in $BENCH_ITERATIONS; do
+            key="$name/$samples/$iterations"
+            out="$BENCH_DIR/$name-$samples-$iterations"
+            quality=$'-\t-\t-'
+            if "$SWINGLINE" "$image" -n "$samples" -i "$iterations" \
+                   $BENCH_FLAGS -o "$out.bin" --metrics "$out.jsonl" \
+                   > /dev/null 2>&1 &&
+               "$SWINGLINE" "$image" -n "$samples" -i $((iterations + 1)) \
+                   --cpu --resume "$out.bin" -o "$out.cpu.bin" \
+                   --metrics "$out.cpu.jsonl" > /dev/null 2>&1; then
+                gpu=$(stats_fields mean_moved_px < "$out.jsonl")
+                cpu=$(stats_fields mean_moved_px max_moved_px \
+                      < "$out.cpu.jsonl")
+                quality="$gpu"$'\t'"$cpu"
+            else
+                echo "Error: run failed for $key" >&2
+                failed=1
+            fi
+            printf "%s\t%s\t%s\n" "$key" "$timings" "$quality" |
+                tee -a "$RESULTS"
+        done
+    done
+done
+
+if [ "$1" = "baseline" ] || [ ! -f "$BENCH_BASELINE" ]; then
+    cp "$RESULTS" "$BENCH_BASELINE" || exit 1
+    echo "Saved baseline to $BENCH_BASELINE"
+    exit $failed
+fi
+
+#   A case regresses if its total time or centroid error grows by more
+#   than the allowed amount; cases missing from either side are skipped
+#   with a warning, and the comparison fails if no case matched at all
+#   (e.g. after changing BENCH_SIZE, BENCH_SAMPLES or BENCH_ITERATIONS)
+awk -F'\t' -v slower="$BENCH_SLOWER" -v worse="$BENCH_WORSE" '
+    function change(now, then) {
+        if (now == "-" || !(then > 0)) {
+            return "-"
+        }
+        return sprintf("%+.1f%%", 100 * (now - then) / then)
+    }
+    NR == FNR { if (FNR > 1) { time[$1] = $5; err[$1] = $7 } next }
+    FNR == 1 {
+        printf "%-24s %10s %8s %12s %8s\n",
+               "case", "total_ms", "change", "centroid_px", "change"
+        next
+    }
+    !($1 in time) { added++; next }
+    {
+        seen[$1] = 1
+        compared++
+        flag = ""
+        if ($5 != "-" && time[$1] != "-" &&
+            $5 > time[$1] * (1 + slower / 100)) {
+            flag = flag " slower"
+        }
+        if ($7 != "-" && err[$1] != "-" &&
+            $7 > err[$1] * (1 + worse / 100) + 0.005) {
+            flag = flag " worse"
+        }
+        printf "%-24s %10s %8s %12s %8s%s\n", $1, $5, change($5, time[$1]),
+               $7, change($7, err[$1]), flag
+        regressed += (flag != "")
+    }
+    END {
+        for (c in time) {
+            missing += !(c in seen)
+        }
+        if (!compared) {
+            print "Error: no case matches the baseline; run" \
+                  " \"make bench-baseline\" to record a new one" > "/dev/stderr"
+            exit 1
+        }
+        if (added || missing) {
+            printf "Warning: %d new case(s) and %d missing case(s) were not" \
+                   " compared; run \"make bench-baseline\" to record them\n",
+                   added, missing > "/dev/stderr"
+        }
+        if (regressed) {
+            printf "%d case(s) regressed against the baseline\n", regressed
+            exit 1
+        }
+        print "No regressions against the baseline"
+    }' "$BENCH_BASELINE" "$RESULTS" || failed=1
+exit $failed
@@ -17,12 +17,19 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 #include <assert.h>
+#include <getopt.h>
 #include <stdlib.h>
 #include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include <epoxy/gl.h>
+#include <epoxy/egl.h>
 #include <GLFW/glfw3.h>
+#include <zlib.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_FAILURE_USERMSG
@@ -30,34 +37,166 @@
 
 /******************************************************************************/
 
-#define GLSL(src) "#version 330 core\n" #src
+/*  Shader sources are compiled after this line and any #defines for the
+ *  variant being built, so the sources themselves can use both  */
+#define GLSL_VERSION "#version 330 core\n"
+#define GLSL(src) #src
 
 const char* voronoi_vert_src = GLSL(
     layout(location=0) in vec3 pos;     /*  Absolute coordinates  */
-    layout(location=1) in vec2 offset;  /*  0 to 1 */
+    layout(location=1) in vec3 offset;  /*  0 to 1, and the weight  */
     uniform vec2 scale;
 
-    out vec3 color_;
+    uniform vec2 origin;    /*  Window origin, in image pixels  */
+    uniform vec2 window;    /*  Window size, in pixels          */
+    uniform vec2 image;     /*  Image size, in pixels           */
+
+    flat out uint id_;
+    out vec2 local_;        /*  Position within the cone or quad  */
 
     void main()
     {
-        gl_Position = vec4(pos.xy*scale + 2.0f*offset - 1.0f, pos.z, 1.0f);
+        // Cones are sized relative to the whole image, then placed within
+        // the window being rendered
+        vec2 o = (offset.xy * image - origin) / window;
+        gl_Position = vec4(pos.xy*scale*image/window + 2.0f*o - 1.0f,
+                           pos.z, 1.0f);
+
+        // Dead points (with a negative weight) are clipped away
+        if (offset.z < 0.0f)
+        {
+            gl_Position = vec4(0.0f, 0.0f, 2.0f, 1.0f);
+        }
 
-        // Pick color based on instance ID
-        int r = gl_InstanceID           % 256;
-        int g = (gl_InstanceID / 256)   % 256;
-        int b = (gl_InstanceID / 65536) % 256;
-        color_ = vec3(r / 255.0f, g / 255.0f, b / 255.0f);
+        // The cell index is the instance ID
+        id_ = uint(gl_InstanceID);
+        local_ = pos.xy;
     }
 );
 
 const char* voronoi_frag_src = GLSL(
-    in vec3 color_;
+    flat in uint id_;
+    layout (location=0) out uint id;
+
+    void main()
+    {
+        id = id_;
+    }
+);
+
+/*  Draws a cone on a single quad, computing its depth exactly  */
+const char* voronoi_quad_frag_src = GLSL(
+    flat in uint id_;
+    in vec2 local_;
+    layout (location=0) out uint id;
+
+    void main()
+    {
+        // Matches the fan's depth, which runs from 0 at the tip to 1 at
+        // the rim (NDC z from -1 to 1)
+        float d = length(local_);
+        if (d > 1.0f)
+        {
+            discard;
+        }
+        gl_FragDepth = d;
+        id = id_;
+    }
+);
+
+/******************************************************************************/
+
+const char* jfa_seed_vert_src = GLSL(
+    layout(location=0) in vec3 pos;     /*  0 to 1  */
+    uniform vec2 size;      /*  Window size, in pixels          */
+    uniform vec2 origin;    /*  Window origin, in image pixels  */
+    uniform vec2 image;     /*  Image size, in pixels           */
+
+    out vec4 seed_;
+
+    void main()
+    {
+        // Snap to the center of the pixel containing the point, clipping
+        // away points outside the window's half-open [0, size) range (a
+        // point on the far edge belongs to the next window, as in
+        // scatter_vert_src)
+        vec2 q = pos.xy * image - origin;
+        vec2 p = clamp(floor(q), vec2(0.0f), size - 1.0f);
+        gl_Position = vec4(2.0f * (p + 0.5f) / size - 1.0f, 0.0f, 1.0f);
+        if (any(lessThan(q, vec2(0.0f))) || any(greaterThanEqual(q, size)) ||
+            pos.z < 0.0f)
+        {
+            gl_Position = vec4(2.0f, 2.0f, 0.0f, 1.0f);
+        }
+
+        // Store the exact location (in pixels) and the cell's index
+        seed_ = vec4(q, gl_VertexID, 1.0f);
+    }
+);
+
+const char* jfa_seed_frag_src = GLSL(
+    in vec4 seed_;
+    layout (location=0) out vec4 color;
+
+    void main()
+    {
+        color = seed_;
+    }
+);
+
+const char* jfa_step_frag_src = GLSL(
+    layout (pixel_center_integer) in vec4 gl_FragCoord;
     layout (location=0) out vec4 color;
 
+    uniform sampler2D seeds;
+    uniform int step;
+
+    void main()
+    {
+        ivec2 tex_size = textureSize(seeds, 0);
+        ivec2 coord = ivec2(gl_FragCoord.xy);
+        vec2 p = coord + 0.5f;
+
+        // Keep the nearest seed among our neighbors at distance step;
+        // seeds are (x, y, index, valid) with valid = 0 for empty pixels
+        color = vec4(0.0f);
+        float best = 0.0f;
+        for (int dy=-1; dy <= 1; ++dy)
+        {
+            for (int dx=-1; dx <= 1; ++dx)
+            {
+                ivec2 q = coord + ivec2(dx, dy) * step;
+                if (any(lessThan(q, ivec2(0))) ||
+                    any(greaterThanEqual(q, tex_size)))
+                {
+                    continue;
+                }
+
+                vec4 t = texelFetch(seeds, q, 0);
+                vec2 d = t.xy - p;
+                float dist = dot(d, d);
+                if (t.w != 0.0f && (color.w == 0.0f || dist < best))
+                {
+                    color = t;
+                    best = dist;
+                }
+            }
+        }
+    }
+);
+
+const char* jfa_encode_frag_src = GLSL(
+    layout (pixel_center_integer) in vec4 gl_FragCoord;
+    layout (location=0) out uint id;
+
+    uniform sampler2D seeds;
+
     void main()
     {
-        color = vec4(color_, 1.0f);
+        // Pixels that no seed reached (only possible in a tile's halo)
+        // get an index that matches no cell
+        vec4 t = texelFetch(seeds, ivec2(gl_FragCoord.xy), 0);
+        id = (t.w != 0.0f) ? uint(t.z) : 0xFFFFFFFFu;
     }
 );
 
@@ -78,7 +217,7 @@ const char* blit_frag_src = GLSL(
     layout (location=0) out vec4 color;
     in vec2 pos_;  /* 0 to 1 range */
 
-    uniform sampler2D tex;
+    uniform usampler2D tex;
 
     float rand(float a, float b)
     {
@@ -87,7 +226,9 @@ const char* blit_frag_src = GLSL(
 
     void main()
     {
-        vec4 t = texture(tex, pos_);
+        // Split the cell index into two bytes to seed the hash
+        uint id = texture(tex, pos_).r;
+        vec2 t = vec2(id % 256u, (id / 256u) % 256u) / 255.0f;
         vec3 rgb = vec3(rand(t.x, t.y), rand(t.y, t.x), rand(t.x - t.y, t.x));
         color = vec4(0.9f + 0.1f*rgb, 1.0f);
     }
@@ -97,26 +238,29 @@ const char* sum_frag_src = GLSL(
     layout (pixel_center_integer) in vec4 gl_FragCoord;
     out vec4 color;
 
-    uniform sampler2D voronoi;
+    uniform usampler2D voronoi;
     uniform sampler2D img;
+    uniform int cols;   /*  Cells per block of rows in the Sum texture  */
 
     void main()
     {
-        int my_index = int(gl_FragCoord.x);
-        ivec2 tex_size = textureSize(voronoi, 0);
+        // Cells are wrapped into blocks of cols cells, each block being
+        // one image height tall.  The size is a constant in this variant,
+        // so the loop below has a fixed trip count.
+        ivec2 tex_size = WINDOW_SIZE;
+        int block = int(gl_FragCoord.y) / tex_size.y;
+        int row = int(gl_FragCoord.y) % tex_size.y;
+        int my_index = block * cols + int(gl_FragCoord.x);
         color = vec4(0.0f);
 
         // Iterate over all columns of the source image, accumulating a
         // weighted sum of the pixels that match our index
         for (int x=0; x < tex_size.x; x++)
         {
-            ivec2 coord = ivec2(x, gl_FragCoord.y);
-            vec4 t = texelFetch(voronoi, coord, 0);
-            int i = int(255.0f * (t.r + (t.g * 256.0f) + (t.b * 65536.0f)));
-            if (i == my_index)
+            ivec2 coord = ivec2(x, row);
+            if (int(texelFetch(voronoi, coord, 0).r) == my_index)
             {
-                float weight = 1.0f - texelFetch(img, coord, 0)[0];
-                weight = 0.01f + 0.99f * weight;
+                float weight = WEIGHT(texelFetch(img, coord, 0)[0]);
 
                 color.xy += (coord + 0.5f) * weight;
                 color.w += weight;
@@ -130,32 +274,415 @@ const char* sum_frag_src = GLSL(
     }
 );
 
+const char* scatter_vert_src = GLSL(
+    out vec4 color_;
+
+    uniform usampler2D voronoi;
+    uniform sampler2D img;
+    uniform int cols;       /*  Cells per row of the Sum texture  */
+    uniform vec2 target;    /*  Size of the Sum texture           */
+
+    uniform vec2 origin;    /*  Window origin, in image pixels    */
+    uniform vec2 image;     /*  Image size, in pixels             */
+    uniform ivec4 owned;    /*  Pixels this window counts (x0, y0, x1, y1) */
+
+    void main()
+    {
+        // Each vertex is one pixel of the Voronoi image
+        ivec2 tex_size = textureSize(voronoi, 0);
+        ivec2 coord = ivec2(gl_VertexID % tex_size.x, gl_VertexID / tex_size.x);
+
+        uint id = texelFetch(voronoi, coord, 0).r;
+        int i = int(id);
+
+        float weight = WEIGHT(texelFetch(img, coord, 0)[0]);
+
+        // Same terms as sum_frag_src, already normalized to the 0 - 1 range
+        vec2 p = (origin + coord + 0.5f) / image;
+        color_ = vec4(p * weight, 1.0f, weight);
+
+        // Land on the texel for our cell, wrapping every cols cells
+        vec2 texel = vec2(i % cols, i / cols) + 0.5f;
+        gl_Position = vec4(2.0f * texel / target - 1.0f, 0.0f, 1.0f);
+
+        // Pixels in another window's territory (or past the image edges)
+        // are clipped away
+        if (id == 0xFFFFFFFFu ||
+            any(lessThan(coord, owned.xy)) ||
+            any(greaterThanEqual(coord, owned.zw)))
+        {
+            gl_Position = vec4(2.0f, 2.0f, 0.0f, 1.0f);
+        }
+    }
+);
+
+const char* scatter_frag_src = GLSL(
+    in vec4 color_;
+    out vec4 color;
+
+    void main()
+    {
+        color = color_;
+    }
+);
+
+const char* reduce_frag_src = GLSL(
+    layout (pixel_center_integer) in vec4 gl_FragCoord;
+    out vec4 color;
+
+    uniform sampler2D summed;
+    uniform int factor;
+    uniform int in_rows;    /*  Rows per block of cells in summed  */
+    uniform int out_rows;   /*  Rows per block of cells in output  */
+
+    void main()
+    {
+        // Each output row sums (up to) factor input rows, without
+        // crossing into the next block of cells
+        int block = int(gl_FragCoord.y) / out_rows;
+        int y0 = (int(gl_FragCoord.y) % out_rows) * factor;
+        int y1 = min(y0 + factor, in_rows);
+
+        color = vec4(0.0f);
+        for (int y=y0; y < y1; ++y)
+        {
+            ivec2 coord = ivec2(gl_FragCoord.x, block * in_rows + y);
+            color += texelFetch(summed, coord, 0);
+        }
+    }
+);
+
 const char* feedback_src = GLSL(
     layout (location=0) in uint index;
+    layout (location=1) in vec3 prev;   /*  Position before this update  */
     out vec3 pos;
+    out float delta;                    /*  Distance moved, in pixels    */
+    out float mass;                     /*  Total weight of the cell     */
+    out float area;                     /*  Pixels in the cell           */
 
-    uniform sampler2D summed;
+    uniform sampler2D summed;   /*  One texel per cell, wrapped every cols */
+    uniform int cols;
+    uniform vec2 size;
+
+    void main()
+    {
+        vec4 t = texelFetch(summed, ivec2(index % uint(cols),
+                                          index / uint(cols)), 0);
+        pos = vec3(t.xy, 0.0f);
+        float weight = t.w;
+        float count = t.z;
+        mass = weight;
+        area = count;
+
+        // Cells with no weight keep their previous state, except that a
+        // cell covering no pixels at all has lost them to a point on top
+        // of it (jump flooding keeps one seed per pixel), so it would sit
+        // there for good; nudge it up to a pixel each way, hashing its
+        // index and position so that repeated nudges go somewhere new
+        if (weight > 0.0f)
+        {
+            pos.xy /= weight;
+            pos.z = weight / count;
+        }
+        else if (count == 0.0f && prev.z >= 0.0f)
+        {
+            uint h = index * 0x9E3779B9u ^ floatBitsToUint(prev.x) ^
+                     floatBitsToUint(prev.y) * 0x85EBCA6Bu;
+            h ^= h >> 16;
+            h *= 0x7FEB352Du;
+            h ^= h >> 15;
+            vec2 d = vec2(h & 0xFFFFu, h >> 16) / 32767.5f - 1.0f;
+            pos = vec3(clamp(prev.xy + d / size, 0.5f / size,
+                             1.0f - 0.5f / size), prev.z);
+        }
+        else
+        {
+            pos = prev;
+        }
+        delta = length((pos.xy - prev.xy) * size);
+    }
+);
+
+/*
+ *  Splits and removes points in --adaptive mode, as in weighted
+ *  Linde-Buzo-Gray stippling: cells that are too light for a dot are
+ *  dropped and cells heavy enough for two are split.  Transform feedback
+ *  packs the survivors at the front of the point buffer.
+ */
+const char* adapt_geom_src = GLSL(
+    layout (points) in;
+    layout (points, max_vertices=2) out;
+
+    in vec3 pos[];
+    in float delta[];
+    in float mass[];
+    in float area[];
+    out vec3 stipple;
+    out float moved;
+
+    uniform float target;       /*  Mass of one full-weight dot   */
+    uniform float hysteresis;
+    uniform int frame;          /*  Varies the split directions   */
+    uniform vec2 size;
 
     void main()
     {
-        ivec2 tex_size = textureSize(summed, 0);
-        pos = vec3(0.0f, 0.0f, 0.0f);
-        float weight = 0.0f;
-        float count = 0;
-        for (int y=0; y < tex_size.y; ++y)
+        if (pos[0].z < 0.0f || mass[0] < (1.0f - hysteresis/2.0f) * target)
+        {
+            return;
+        }
+        if (mass[0] <= (1.0f + hysteresis/2.0f) * target)
         {
-            vec4 t = texelFetch(summed, ivec2(index, y), 0);
-            pos.xy += t.xy;
-            weight += t.w;
-            count += t.z;
+            stipple = pos[0];
+            moved = delta[0];
+            EmitVertex();
+            return;
         }
-        pos.xy /= weight;
-        pos.z = weight / count;
+
+        // Split in a pseudo-random direction, a quarter of the cell's
+        // radius each way
+        uint h = uint(gl_PrimitiveIDIn) * 0x9E3779B9u ^
+                 uint(frame) * 0x85EBCA6Bu;
+        h ^= h >> 16;
+        h *= 0x7FEB352Du;
+        h ^= h >> 15;
+        float a = float(h) * (6.2831853f / 4294967296.0f);
+        vec2 d = vec2(cos(a), sin(a)) * 0.25f *
+                 sqrt(area[0] / 3.1415927f) / size;
+
+        stipple = vec3(pos[0].xy + d, pos[0].z);
+        moved = delta[0];
+        EmitVertex();
+        stipple = vec3(pos[0].xy - d, pos[0].z);
+        moved = delta[0];
+        EmitVertex();
+    }
+);
+
+const char* stats_vert_src = GLSL(
+    layout (location=0) in float delta;     /*  Negative for dead points  */
+    layout (location=1) in vec3 point;      /*  Position and weight       */
+    uniform float target;   /*  x coordinate of the output pixel  */
+    uniform int channel;    /*  0 for the max, 1 for the sum, 2 to count,
+                                3 for the sum of weights             */
+
+    out float value_;
+
+    void main()
+    {
+        gl_Position = vec4(target, 0.0f, 0.0f, 1.0f);
+        value_ = (channel == 0) ? delta
+               : (delta < 0.0f) ? 0.0f
+               : (channel == 1) ? delta
+               : (channel == 2) ? 1.0f : point.z;
+    }
+);
+
+const char* stats_frag_src = GLSL(
+    in float value_;
+    layout (location=0) out vec4 color;
+
+    void main()
+    {
+        color = vec4(value_, 0.0f, 0.0f, 1.0f);
     }
 );
 
 /******************************************************************************/
 
+/*
+ *  Returns wall-clock time in seconds from a monotonic clock
+ */
+double wall_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ *  Optional telemetry, written from any thread: JSON lines for --metrics
+ *  and Chrome trace events (chrome://tracing, Perfetto) for --trace.  The
+ *  global is NULL unless one was requested, so instrumented code only
+ *  tests a pointer when telemetry is off.
+ */
+typedef struct Telemetry_
+{
+    FILE* metrics;
+    FILE* trace;
+    unsigned events;    /*  Written to the trace so far  */
+    unsigned threads;   /*  Thread ids handed out so far */
+    double start;       /*  Trace timestamps count from here  */
+    pthread_mutex_t lock;
+} Telemetry;
+
+Telemetry* telemetry = NULL;
+
+/*  Small per-thread id for trace events, or 0 before the first  */
+__thread unsigned telemetry_tid;
+
+/*
+ *  Returns where progress messages go: stdout, unless metrics are being
+ *  written there
+ */
+FILE* progress_file()
+{
+    return (telemetry && telemetry->metrics == stdout) ? stderr : stdout;
+}
+
+/*
+ *  Writes a string as a quoted JSON string
+ */
+void json_string(FILE* f, const char* s)
+{
+    fputc('"', f);
+    for (; *s; ++s)
+    {
+        if (*s == '"' || *s == '\\')        fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)  fprintf(f, "\\u%04x", *s);
+        else                                fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+/*
+ *  Opens a telemetry output, where - means stdout
+ */
+FILE* telemetry_file(const char* path)
+{
+    if (!strcmp(path, "-"))
+    {
+        return stdout;
+    }
+    FILE* f = fopen(path, "w");
+    if (!f)
+    {
+        fprintf(stderr, "Error: couldn't open %s for writing\n", path);
+        exit(-1);
+    }
+    return f;
+}
+
+void telemetry_close()
+{
+    if (telemetry->trace)
+    {
+        fprintf(telemetry->trace, "\n]\n");
+    }
+    for (unsigned i=0; i < 2; ++i)
+    {
+        FILE* f = i ? telemetry->trace : telemetry->metrics;
+        if (f && f != stdout)
+        {
+            fclose(f);
+        }
+        else if (f)
+        {
+            fflush(f);
+        }
+    }
+}
+
+/*
+ *  Starts telemetry if either output is given (both may be NULL), closing
+ *  the outputs at exit
+ */
+void telemetry_open(const char* metrics, const char* trace)
+{
+    if (!metrics && !trace)
+    {
+        return;
+    }
+    telemetry = (Telemetry*)calloc(1, sizeof(Telemetry));
+    telemetry->metrics = metrics ? telemetry_file(metrics) : NULL;
+    telemetry->trace = trace ? telemetry_file(trace) : NULL;
+    telemetry->start = wall_time();
+    pthread_mutex_init(&telemetry->lock, NULL);
+    if (telemetry->trace)
+    {
+        fprintf(telemetry->trace, "[");
+    }
+    atexit(telemetry_close);
+}
+
+/*
+ *  Locks the telemetry outputs, giving this thread its id if it has none
+ */
+void telemetry_lock()
+{
+    pthread_mutex_lock(&telemetry->lock);
+    if (!telemetry_tid)
+    {
+        telemetry_tid = ++telemetry->threads;
+    }
+}
+
+void telemetry_unlock()
+{
+    pthread_mutex_unlock(&telemetry->lock);
+}
+
+/*
+ *  Starts a trace event in the Chrome format, leaving it open for args
+ */
+void telemetry_trace_event(const char* name, char phase, double time)
+{
+    fprintf(telemetry->trace, "%s\n{\"name\": \"%s\", \"cat\": \"swingline\", "
+            "\"ph\": \"%c\", \"ts\": %.1f, \"pid\": %i, \"tid\": %u",
+            telemetry->events++ ? "," : "", name, phase,
+            (time - telemetry->start) * 1e6, (int)getpid(), telemetry_tid);
+}
+
+/*
+ *  Returns the start time for span_end, or 0 with telemetry off
+ */
+double span_begin()
+{
+    return telemetry ? wall_time() : 0;
+}
+
+/*
+ *  Records a span of wall-clock time from span_begin until now, with an
+ *  optional detail string (e.g. a file name)
+ */
+void span_end(const char* name, const char* detail, double start)
+{
+    if (!telemetry)
+    {
+        return;
+    }
+    const double end = wall_time();
+
+    telemetry_lock();
+    if (telemetry->metrics)
+    {
+        fprintf(telemetry->metrics, "{\"type\": \"span\", \"name\": \"%s\", "
+                "\"thread\": %u, \"ms\": %.3f", name, telemetry_tid,
+                (end - start) * 1e3);
+        if (detail)
+        {
+            fprintf(telemetry->metrics, ", \"detail\": ");
+            json_string(telemetry->metrics, detail);
+        }
+        fprintf(telemetry->metrics, "}\n");
+    }
+    if (telemetry->trace)
+    {
+        telemetry_trace_event(name, 'X', start);
+        fprintf(telemetry->trace, ", \"dur\": %.1f", (end - start) * 1e6);
+        if (detail)
+        {
+            fprintf(telemetry->trace, ", \"args\": {\"detail\": ");
+            json_string(telemetry->trace, detail);
+            fprintf(telemetry->trace, "}");
+        }
+        fprintf(telemetry->trace, "}");
+    }
+    telemetry_unlock();
+}
+
+/******************************************************************************/
+
 void check_shader(GLuint shader)
 {
     GLint status;
@@ -172,12 +699,18 @@ void check_shader(GLuint shader)
     }
 }
 
-GLuint shader_compile(GLenum type, const GLchar* src)
+/*
+ *  Compiles a shader from its source, with the version line and then the
+ *  given #defines (which may be NULL) in front
+ */
+GLuint shader_compile(GLenum type, const GLchar* defines, const GLchar* src)
 {
-    assert(type == GL_VERTEX_SHADER || type == GL_FRAGMENT_SHADER);
+    assert(type == GL_VERTEX_SHADER || type == GL_GEOMETRY_SHADER ||
+           type == GL_FRAGMENT_SHADER);
 
+    const GLchar* lines[3] = {GLSL_VERSION, defines ? defines : "", src};
     GLuint shader = glCreateShader(type);
-    glShaderSource(shader, 1, &src, NULL);
+    glShaderSource(shader, 3, lines, NULL);
     glCompileShader(shader);
 
     check_shader(shader);
@@ -200,433 +733,4037 @@ void program_check(GLuint program)
     }
 }
 
-GLuint program_link(GLuint vert, GLuint frag)
-{
-    GLuint program = glCreateProgram();
-    glAttachShader(program, vert);
-    glAttachShader(program, frag);
-    glLinkProgram(program);
+/*  Directory where linked programs are cached, or NULL to always compile  */
+const char* program_cache = NULL;
 
-    program_check(program);
-    return program;
+/*  Leads every cached program binary  */
+typedef struct {
+    char magic[4];      /*  "SWPB"  */
+    uint32_t format;    /*  From glGetProgramBinary */
+    uint32_t length;
+} ProgramCacheHeader;
+
+/*
+ *  Mixes a string into a 64-bit FNV-1a hash.  The terminator is included,
+ *  so that consecutive strings can't run together; NULL hashes like "".
+ */
+uint64_t hash_string(uint64_t h, const char* s)
+{
+    s = s ? s : "";
+    do
+    {
+        h = (h ^ (uint8_t)*s) * 1099511628211ull;
+    } while (*s++);
+    return h;
 }
 
-void teardown(GLint* viewport)
+/*
+ *  Finds the cache file for a program, keyed by its sources and by the
+ *  driver that would build it.  Returns false if programs can't be cached
+ *  (no directory, or no binary formats in this context).
+ */
+bool program_cache_path(const GLchar* defines, const GLchar* const src[3],
+                        GLsizei count,
+                        const GLchar** varyings, char* path, size_t size)
 {
-    glBindVertexArray(0);
-    glUseProgram(0);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    glBindTexture(GL_TEXTURE_2D, 0);
+    if (!program_cache ||
+        (epoxy_gl_version() < 41 &&
+         !epoxy_has_gl_extension("GL_ARB_get_program_binary")))
+    {
+        return false;
+    }
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    if (!formats)
+    {
+        return false;
+    }
 
-    if (viewport)
+    uint64_t h = 14695981039346656037ull;
+    h = hash_string(h, (const char*)glGetString(GL_VENDOR));
+    h = hash_string(h, (const char*)glGetString(GL_RENDERER));
+    h = hash_string(h, (const char*)glGetString(GL_VERSION));
+    h = hash_string(h, defines);
+    for (unsigned i=0; i < 3; ++i)
+    {
+        h = hash_string(h, src[i]);
+    }
+    for (GLsizei i=0; i < count; ++i)
     {
-        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+        h = hash_string(h, varyings[i]);
     }
+    return snprintf(path, size, "%s/%016llx.bin", program_cache,
+                    (unsigned long long)h) < (int)size;
 }
 
-/******************************************************************************/
-
-/******************************************************************************/
-
 /*
- *  Builds a quad covering the viewport, returning the relevant VAO
+ *  Loads a cached binary into the given program, returning false if it's
+ *  missing or the driver rejects it
  */
-GLuint quad_new()
+bool program_cache_load(GLuint program, const char* path)
 {
-    GLfloat verts[] = {-1.0f, -1.0f,     1.0f, -1.0f,
-                        1.0f,  1.0f,    -1.0f,  1.0f};
-    GLuint vbo;
-    GLuint vao;
+    FILE* f = fopen(path, "rb");
+    if (!f)
+    {
+        return false;
+    }
 
-    glGenVertexArrays(1, &vao);
-    glGenBuffers(1, &vbo);
+    ProgramCacheHeader header;
+    void* binary = NULL;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1 &&
+              !memcmp(header.magic, "SWPB", 4) &&
+              (binary = malloc(header.length)) &&
+              fread(binary, 1, header.length, f) == header.length;
+    fclose(f);
 
-    glBindVertexArray(vao);
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW);
+    if (ok)
+    {
+        glProgramBinary(program, header.format, binary, header.length);
+        GLint status;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        ok = status == GL_TRUE;
+    }
+    free(binary);
+    return ok;
+}
+
+/*
+ *  Stores a linked program's binary.  The cache is best-effort, so
+ *  failures are ignored; the file is written under a temporary name and
+ *  renamed, since other processes may be reading the cache.
+ */
+void program_cache_save(GLuint program, const char* path)
+{
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+    {
+        return;
+    }
+
+    ProgramCacheHeader header = {.magic = "SWPB", .length = length};
+    void* binary = malloc(length);
+    GLenum format;
+    glGetProgramBinary(program, length, NULL, &format, binary);
+    header.format = format;
+
+    /*  Creates each missing directory in the cache path  */
+    char* dir = strdup(program_cache);
+    for (char* c = dir + 1; *c; ++c)
+    {
+        if (*c == '/')
+        {
+            *c = '\0';
+            mkdir(dir, 0755);
+            *c = '/';
+        }
+    }
+    mkdir(dir, 0755);
+    free(dir);
+
+    char* tmp = (char*)malloc(strlen(path) + 8);
+    sprintf(tmp, "%s.XXXXXX", path);
+    const int fd = mkstemp(tmp);
+    FILE* f = (fd >= 0) ? fdopen(fd, "wb") : NULL;
+    if (f)
+    {
+        bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+                  fwrite(binary, 1, length, f) == (size_t)length;
+        ok = !fclose(f) && ok;
+        if (!ok || rename(tmp, path))
+        {
+            unlink(tmp);
+        }
+    }
+    else if (fd >= 0)
+    {
+        close(fd);
+        unlink(tmp);
+    }
+    free(tmp);
+    free(binary);
+}
+
+/*
+ *  Builds a program from vertex, geometry and fragment shader sources
+ *  (geometry and fragment may be NULL), each compiled with the given
+ *  #defines, capturing count transform feedback varyings into separate
+ *  buffers.  Linked programs are loaded from the cache when it holds a
+ *  binary built from the same sources and defines by the same driver,
+ *  and stored there otherwise.
+ */
+GLuint program_build(const GLchar* defines, const GLchar* vert,
+                     const GLchar* geom, const GLchar* frag,
+                     GLsizei count, const GLchar** varyings)
+{
+    const GLchar* const src[3] = {vert, geom, frag};
+    char path[4096];
+    const bool cached = program_cache_path(defines, src, count, varyings,
+                                           path, sizeof(path));
+
+    const double start = span_begin();
+    GLuint program = glCreateProgram();
+    if (cached && program_cache_load(program, path))
+    {
+        span_end("program", "cached", start);
+        return program;
+    }
+    glDeleteProgram(program);
+    program = glCreateProgram();
+
+    const GLenum types[3] = {GL_VERTEX_SHADER, GL_GEOMETRY_SHADER,
+                             GL_FRAGMENT_SHADER};
+    GLuint shaders[3] = {0, 0, 0};
+    for (unsigned i=0; i < 3; ++i)
+    {
+        if (src[i])
+        {
+            shaders[i] = shader_compile(types[i], defines, src[i]);
+            glAttachShader(program, shaders[i]);
+        }
+    }
+    if (count)
+    {
+        glTransformFeedbackVaryings(program, count, varyings,
+                                    GL_SEPARATE_ATTRIBS);
+    }
+    if (cached)
+    {
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+                            GL_TRUE);
+    }
+    glLinkProgram(program);
+    program_check(program);
+
+    for (unsigned i=0; i < 3; ++i)
+    {
+        if (shaders[i])
+        {
+            glDetachShader(program, shaders[i]);
+            glDeleteShader(shaders[i]);
+        }
+    }
+
+    if (cached)
+    {
+        program_cache_save(program, path);
+    }
+    span_end("program", "compiled", start);
+    return program;
+}
+
+/*
+ *  Builds a program from vertex and fragment shader sources
+ */
+GLuint program_new(const GLchar* vert, const GLchar* frag)
+{
+    return program_build(NULL, vert, NULL, frag, 0, NULL);
+}
+
+/*
+ *  Bindings and capabilities that change from stage to stage are tracked
+ *  here, so that an iteration only issues the calls that change something.
+ *  Setup code may bind things freely, then calls state_reset when done.
+ *  The initial values match a freshly-created context.
+ */
+typedef struct GlState_ {
+    GLuint fbo;
+    GLsizei width, height;  /*  Viewport, or 0 x 0 if unknown   */
+    GLuint prog;
+    GLuint vao;
+    bool depth_test;
+    bool blend;
+    GLenum equation;        /*  Blend equation, or 0 if unknown */
+} GlState;
+
+__thread GlState gl_state;
+
+/*
+ *  Binds a framebuffer and sets the viewport to cover width x height
+ */
+void state_framebuffer(GLuint fbo, GLsizei width, GLsizei height)
+{
+    if (fbo != gl_state.fbo)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        gl_state.fbo = fbo;
+    }
+    if (width != gl_state.width || height != gl_state.height)
+    {
+        glViewport(0, 0, width, height);
+        gl_state.width = width;
+        gl_state.height = height;
+    }
+}
+
+void state_program(GLuint prog)
+{
+    if (prog != gl_state.prog)
+    {
+        glUseProgram(prog);
+        gl_state.prog = prog;
+    }
+}
+
+void state_vao(GLuint vao)
+{
+    if (vao != gl_state.vao)
+    {
+        glBindVertexArray(vao);
+        gl_state.vao = vao;
+    }
+}
+
+void state_depth_test(bool enable)
+{
+    if (enable != gl_state.depth_test)
+    {
+        (enable ? glEnable : glDisable)(GL_DEPTH_TEST);
+        gl_state.depth_test = enable;
+    }
+}
+
+/*
+ *  Enables additive (GL_ONE, GL_ONE) blending with the given equation,
+ *  or disables blending if it is 0
+ */
+void state_blend(GLenum equation)
+{
+    const bool enable = equation != 0;
+    if (enable != gl_state.blend)
+    {
+        (enable ? glEnable : glDisable)(GL_BLEND);
+        gl_state.blend = enable;
+    }
+    if (enable && equation != gl_state.equation)
+    {
+        glBlendEquation(equation);
+        gl_state.equation = equation;
+    }
+}
+
+/*
+ *  Unbinds everything after setup code has bound objects behind the
+ *  tracker's back
+ */
+void state_reset()
+{
+    glBindVertexArray(0);
+    glUseProgram(0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    gl_state.fbo = 0;
+    gl_state.prog = 0;
+    gl_state.vao = 0;
+}
+
+/******************************************************************************/
+
+/******************************************************************************/
+
+/*
+ *  Builds a quad covering the viewport, returning the relevant VAO
+ */
+GLuint quad_new()
+{
+    GLfloat verts[] = {-1.0f, -1.0f,     1.0f, -1.0f,
+                        1.0f,  1.0f,    -1.0f,  1.0f};
+    GLuint vbo;
+    GLuint vao;
+
+    glGenVertexArrays(1, &vao);
+    glGenBuffers(1, &vbo);
+
+    glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW);
         glEnableVertexAttribArray(0);
         glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
     glBindVertexArray(0);
     return vao;
 }
 
-/******************************************************************************/
+/******************************************************************************/
+
+typedef struct Context_ {
+    GLFWwindow* window;     /*  Window, or NULL for a headless context  */
+
+    EGLDisplay display;     /*  Only used for headless contexts */
+    EGLContext context;
+    EGLSurface surface;     /*  EGL_NO_SURFACE if surfaceless   */
+} Context;
+
+/*
+ *  Checks that the current context is new enough, exiting otherwise
+ */
+void context_check_version()
+{
+    const GLubyte* ver = glGetString(GL_VERSION);
+    const uint8_t major = ver[0] - '0';
+    const uint8_t minor = ver[2] - '0';
+    if (major * 10 + minor < 33)
+    {
+        fprintf(stderr, "Error: OpenGL context is too old"
+                        " (require 3.3, got %u.%u)\n", major, minor);
+        exit(-1);
+    }
+}
+
+#define EGL_MAX_DEVICES 16
+
+/*
+ *  Returns the number of EGL devices (usually GPUs) that can be opened
+ *  without a window system
+ */
+unsigned egl_device_count()
+{
+    EGLint count = 0;
+    if (epoxy_has_egl_extension(EGL_NO_DISPLAY, "EGL_EXT_platform_device"))
+    {
+        EGLDeviceEXT devices[EGL_MAX_DEVICES];
+        eglQueryDevicesEXT(EGL_MAX_DEVICES, devices, &count);
+    }
+    return count;
+}
+
+/*
+ *  Finds an EGL display that doesn't need a window system.  With a
+ *  negative device, it prefers any GPU device, then Mesa's surfaceless
+ *  platform, then the default display; otherwise only the given device
+ *  will do.  Returns an initialized display or EGL_NO_DISPLAY.
+ */
+EGLDisplay egl_display(int device)
+{
+    if (epoxy_has_egl_extension(EGL_NO_DISPLAY, "EGL_EXT_platform_device"))
+    {
+        EGLDeviceEXT devices[EGL_MAX_DEVICES];
+        EGLint count = 0;
+        eglQueryDevicesEXT(EGL_MAX_DEVICES, devices, &count);
+        for (EGLint i=(device < 0) ? 0 : device; i < count; ++i)
+        {
+            EGLDisplay d = eglGetPlatformDisplayEXT(
+                    EGL_PLATFORM_DEVICE_EXT, devices[i], NULL);
+            if (d != EGL_NO_DISPLAY && eglInitialize(d, NULL, NULL))
+            {
+                return d;
+            }
+            else if (device >= 0)
+            {
+                break;
+            }
+        }
+    }
+    if (device >= 0)
+    {
+        return EGL_NO_DISPLAY;
+    }
+
+    if (epoxy_has_egl_extension(EGL_NO_DISPLAY,
+                                "EGL_MESA_platform_surfaceless"))
+    {
+        EGLDisplay d = eglGetPlatformDisplayEXT(
+                EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+        if (d != EGL_NO_DISPLAY && eglInitialize(d, NULL, NULL))
+        {
+            return d;
+        }
+    }
+
+    EGLDisplay d = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (d != EGL_NO_DISPLAY && eglInitialize(d, NULL, NULL))
+    {
+        return d;
+    }
+    return EGL_NO_DISPLAY;
+}
+
+/*
+ *  Creates a headless OpenGL context through EGL (on the given device, as
+ *  for egl_display) and makes it current.  Returns false (leaving ctx
+ *  untouched) if no suitable display exists.
+ */
+bool egl_context(Context* ctx, int device)
+{
+    EGLDisplay display = egl_display(device);
+    if (display == EGL_NO_DISPLAY || !eglBindAPI(EGL_OPENGL_API))
+    {
+        return false;
+    }
+
+    /*  A surface is only needed if the driver can't go without  */
+    const bool surfaceless =
+        epoxy_has_egl_extension(display, "EGL_KHR_surfaceless_context");
+    const EGLint config_attribs[] = {
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
+        EGL_NONE};
+    EGLConfig config;
+    EGLint count = 0;
+    if (!eglChooseConfig(display, config_attribs, &config, 1, &count) ||
+        count == 0)
+    {
+        eglTerminate(display);
+        return false;
+    }
+
+    const EGLint context_attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION_KHR, 3,
+        EGL_CONTEXT_MINOR_VERSION_KHR, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR,
+            EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR,
+        EGL_NONE};
+    EGLContext context = eglCreateContext(
+            display, config, EGL_NO_CONTEXT, context_attribs);
+    if (context == EGL_NO_CONTEXT)
+    {
+        eglTerminate(display);
+        return false;
+    }
+
+    EGLSurface surface = EGL_NO_SURFACE;
+    if (!surfaceless)
+    {
+        const EGLint pbuffer_attribs[] = {
+            EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+        surface = eglCreatePbufferSurface(display, config, pbuffer_attribs);
+    }
+
+    if ((!surfaceless && surface == EGL_NO_SURFACE) ||
+        !eglMakeCurrent(display, surface, surface, context))
+    {
+        eglDestroyContext(display, context);
+        eglTerminate(display);
+        return false;
+    }
+
+    ctx->display = display;
+    ctx->context = context;
+    ctx->surface = surface;
+    return true;
+}
+
+/*
+ *  Sets the state that stays fixed for the life of a context
+ */
+void context_defaults()
+{
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClearDepth(1.0f);
+    glBlendFunc(GL_ONE, GL_ONE);
+    gl_state = (GlState){ .fbo = 0 };
+}
+
+/*
+ *  Creates an OpenGL context (3.3 or higher) and makes it current.
+ *  Headless contexts come from EGL if possible, so they don't need a
+ *  window system, falling back to a hidden GLFW window.
+ */
+Context* make_context(uint32_t width, uint32_t height, bool headless)
+{
+    const double start = span_begin();
+    Context* ctx = (Context*)calloc(1, sizeof(Context));
+    if (headless && egl_context(ctx, -1))
+    {
+        context_check_version();
+        context_defaults();
+        span_end("context", "egl", start);
+        return ctx;
+    }
+
+    if (!glfwInit())
+    {
+        fprintf(stderr, "Error: Failed to initialize GLFW!\n");
+        exit(-1);
+    }
+
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_VISIBLE, !headless);
+
+    GLFWwindow* const window = glfwCreateWindow(
+            width, height, "swingline", NULL, NULL);
+
+    if (!window)
+    {
+        fprintf(stderr, "Error:  Failed to create window");
+        exit(-1);
+    }
+
+    glfwMakeContextCurrent(window);
+    context_check_version();
+    context_defaults();
+    span_end("context", "glfw", start);
+
+    ctx->window = window;
+    return ctx;
+}
+
+/*
+ *  Creates a headless context on one EGL device and makes it current on
+ *  the calling thread.  Returns NULL if that isn't possible.
+ */
+Context* device_context(int device)
+{
+    const double start = span_begin();
+    Context* ctx = (Context*)calloc(1, sizeof(Context));
+    if (!egl_context(ctx, device))
+    {
+        free(ctx);
+        return NULL;
+    }
+    context_check_version();
+    context_defaults();
+    span_end("context", "egl device", start);
+    return ctx;
+}
+
+/******************************************************************************/
+
+GLuint texture_new()
+{
+    GLuint tex;
+    glGenTextures(1, &tex);
+
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+
+    return tex;
+}
+
+/******************************************************************************/
+
+void fbo_check(const char* description)
+{   /*  Check to see if the framebuffer is complete  */
+    int status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+    {
+        fprintf(stderr, "Error: %s framebuffer is incomplete (%i)\n",
+                description, status);
+        exit(-1);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*  Strategies for accumulating weighted centroids in the Sum stage  */
+typedef enum {
+    CENTROID_SCATTER,       /*  One additive point per pixel, cols x blocks */
+    CENTROID_ROWS,          /*  Per-row column walk, cols x blocks x height */
+} CentroidEngine;
+
+const char* centroid_names[] = {"scatter", "rows"};
+
+/*  Storage for the partial sums written by the Sum stage  */
+typedef enum {
+    SUM_RGBA32F,            /*  Full float sums                          */
+    SUM_RGBA16F,            /*  Half-float per-row partials (rows only)  */
+} SumFormat;
+
+const char* sum_format_names[] = {"rgba32f", "rgba16f"};
+const GLint sum_format_gl[] = {GL_RGBA32F, GL_RGBA16F};
+const unsigned sum_format_bytes[] = {16, 8};
+
+/*  Widest row whose pixel counts are exact in a half float (11 significant
+ *  bits); weighted sums carry about 5e-4 relative error at any width, or
+ *  up to a pixel of centroid bias at the far edge of the widest row  */
+#define SUM_HALF_MAX_WIDTH 2048
+
+/*  Geometry used to draw each point's cone in VORONOI_CONES  */
+typedef enum {
+    CONE_FAN,               /*  Triangle fan of cfg->resolution segments */
+    CONE_QUAD,              /*  One quad with per-fragment depth          */
+} ConeShape;
+
+/*  Strategies for building the Voronoi cell-index image  */
+typedef enum {
+    VORONOI_CONES,          /*  Depth-tested instanced cones             */
+    VORONOI_JFA,            /*  Jump flooding from seeded points         */
+} VoronoiEngine;
+
+const char* voronoi_names[] = {"cones", "jfa"};
+
+/*  Stipple output formats, chosen by --format or the file extension  */
+typedef enum {
+    OUTPUT_AUTO,
+    OUTPUT_SVG,
+    OUTPUT_CSV,
+    OUTPUT_BIN,
+} OutputFormat;
+
+const char* output_names[] = {"auto", "svg", "csv", "bin"};
+
+/*  Output formats for --bench results  */
+typedef enum {
+    BENCH_CSV,
+    BENCH_JSON,
+} BenchFormat;
+
+/*
+ *  An 8-bit grayscale image that stays on disk and is read a window at a
+ *  time: either a binary PGM file or, for other formats, a temporary file
+ *  holding the decoded pixels
+ */
+typedef struct TileSource_ {
+    FILE* file;
+    off_t offset;           /*  Start of the pixel data         */
+    bool top_down;          /*  Rows are stored top row first   */
+    uint32_t width, height;
+} TileSource;
+
+/*
+ *  Parses the header of an 8-bit binary PGM file, leaving the file at the
+ *  start of its pixel data.  Returns false for anything else.
+ */
+bool pgm_header(FILE* f, uint32_t* width, uint32_t* height)
+{
+    unsigned w, h, maxval;
+    if (fscanf(f, "P5 %u %u %u", &w, &h, &maxval) != 3 || maxval != 255 ||
+        fgetc(f) == EOF || !w || !h)
+    {
+        return false;
+    }
+    *width = w;
+    *height = h;
+    return true;
+}
+
+/*
+ *  Opens an image for streaming.  Binary PGM files are read in place;
+ *  anything else is decoded once and spilled to a temporary file, so the
+ *  decoded image is never held in memory for longer than that.  Prints an
+ *  error and returns NULL on failure.
+ */
+TileSource* tile_source_open(const char* filename)
+{
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+    {
+        perror("File opening failed");
+        return NULL;
+    }
+
+    TileSource* src = (TileSource*)calloc(1, sizeof(TileSource));
+    if (pgm_header(f, &src->width, &src->height))
+    {
+        src->file = f;
+        src->offset = ftello(f);
+        src->top_down = true;
+        return src;
+    }
+    fclose(f);
+
+    int x, y;
+    stbi_set_flip_vertically_on_load_thread(true);
+    stbi_uc* img = stbi_load(filename, &x, &y, NULL, 1);
+    if (img == NULL)
+    {
+        fprintf(stderr, "Error loading image %s: %s\n",
+                filename, stbi_failure_reason());
+        free(src);
+        return NULL;
+    }
+
+    src->width = x;
+    src->height = y;
+    src->file = tmpfile();
+    const size_t bytes = (size_t)x * y;
+    if (!src->file || fwrite(img, 1, bytes, src->file) != bytes)
+    {
+        perror("Failed to spill decoded image");
+        if (src->file)
+        {
+            fclose(src->file);
+        }
+        stbi_image_free(img);
+        free(src);
+        return NULL;
+    }
+    stbi_image_free(img);
+    return src;
+}
+
+void tile_source_close(TileSource* src)
+{
+    fclose(src->file);
+    free(src);
+}
+
+/*
+ *  Reads a w x h window with its lower-left corner at (x, y), in the same
+ *  bottom-up orientation as stb_image's flipped output.  Pixels past the
+ *  image edges are filled with white.  Returns false on read errors.
+ */
+bool tile_source_read(TileSource* src, int32_t x, int32_t y,
+                      uint32_t w, uint32_t h, stbi_uc* out)
+{
+    memset(out, 255, (size_t)w * h);
+
+    const int64_t x0 = (x > 0) ? x : 0;
+    const int64_t x1 = ((int64_t)x + w < src->width) ? (int64_t)x + w
+                                                     : src->width;
+    if (x1 <= x0)
+    {
+        return true;
+    }
+
+    for (uint32_t r=0; r < h; ++r)
+    {
+        const int64_t gy = (int64_t)y + r;
+        if (gy < 0 || gy >= src->height)
+        {
+            continue;
+        }
+        const int64_t row = src->top_down ? src->height - 1 - gy : gy;
+        const size_t n = x1 - x0;
+        if (fseeko(src->file, src->offset + (off_t)(row * src->width + x0),
+                   SEEK_SET) ||
+            fread(out + (size_t)r * w + (x0 - x), 1, n, src->file) != n)
+        {
+            fprintf(stderr, "Error: failed to read image tile\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ *  A region of the image rendered in one pass.  All windows share the size
+ *  of the Voronoi targets; they may hang past the image edges and overlap
+ *  their neighbours by a halo, but each pixel is owned (and counted) by
+ *  exactly one window.
+ */
+typedef struct Window_ {
+    int32_t x, y;           /*  Origin in image pixels                  */
+    int32_t x0, y0, x1, y1; /*  Owned pixels, in window coordinates     */
+} Window;
+
+typedef struct Config_ {
+    stbi_uc* img;           /*  Pointer to raw image data  */
+
+    uint32_t width, height; /*  Image size   */
+    uint32_t samples;       /*  Number of Voronoi cells */
+    uint32_t seeds;         /*  Cells that start out live; fewer than
+                                samples in --adaptive mode, where the
+                                rest is spare capacity                  */
+    bool adaptive;          /*  Split and remove cells by their mass    */
+    uint32_t resolution;    /*  Segments per cone and dot, or 0 to pick
+                                them from the expected cell size        */
+    ConeShape cone;         /*  Cone geometry  */
+
+    float sx, sy;           /*  Scale (used to adjust for aspect ratio) */
+    float radius;           /*  Stipple radius (in arbitrary units)     */
+    float gamma;            /*  Density is darkness to this power       */
+    bool invert;            /*  Place points by brightness instead      */
+
+    CentroidEngine centroid;    /*  Centroid accumulation strategy  */
+    SumFormat sum_format;       /*  Storage for the partial sums    */
+    VoronoiEngine voronoi;      /*  Voronoi rendering strategy      */
+
+    int iter;               /*  Number of iterations; -1 if interactive */
+    float tolerance;        /*  Stop once no point moves further than
+                                this (in pixels); 0 to disable          */
+    const char* image;      /*  Input file name   */
+    const char* out;        /*  Output file name  */
+    int precision;          /*  Decimal places in text output  */
+    OutputFormat format;    /*  Output format, or OUTPUT_AUTO  */
+    const char* batch;      /*  Batch manifest file name, or NULL  */
+
+    float (*start)[3];      /*  Points to start from instead of seeding  */
+    uint32_t start_iter;    /*  Iterations already run to reach 'start'  */
+    const char* checkpoint; /*  Checkpoint file name, or NULL  */
+    int every;              /*  Iterations between checkpoints  */
+    unsigned pyramid;       /*  Resolution levels to relax through  */
+
+    bool cpu;               /*  Run on the CPU instead of through GL    */
+    unsigned threads;       /*  Worker threads for CPU work  */
+    uint64_t seed;          /*  Seed for the initial points  */
+    uint32_t max_size;      /*  Downsample larger images to this, or 0  */
+    unsigned prefetch;      /*  Images decoded ahead in --batch mode    */
+    int sequence;           /*  Iterations per warm-started frame, or 0 */
+    unsigned devices;       /*  GPUs sharing --batch jobs, or 0 for all */
+    unsigned steps;         /*  Steps per frame when interactive, or 0
+                                to fit them to the frame time        */
+    bool vsync;             /*  Sync interactive frames to the display  */
+    char* shader_cache;     /*  Directory of linked programs, or NULL   */
+    const char* metrics;    /*  JSON lines telemetry file, or NULL      */
+    const char* trace;      /*  Chrome trace file, or NULL              */
+
+    uint32_t tile;          /*  Window size in --tile mode, or 0        */
+    TileSource* source;     /*  Image on disk in --tile mode (img is NULL) */
+
+    int bench;              /*  Timed iterations in --bench mode, or 0  */
+    int warmup;             /*  Untimed iterations before benchmarking  */
+    BenchFormat bench_format;
+} Config;
+
+/*
+ *  Returns the overlap between neighbouring windows in --tile mode.  Cones
+ *  are drawn for every point from every window, so they need none; jump
+ *  flooding only sees seeds inside the window, so windows get a margin of
+ *  a few typical cell widths.
+ */
+uint32_t config_halo(const Config* c)
+{
+    if (!c->tile || c->voronoi == VORONOI_CONES)
+    {
+        return 0;
+    }
+    const uint32_t halo = ceil(4 * sqrt((double)c->width * c->height /
+                                        c->samples));
+    return (halo < c->tile) ? halo : c->tile;
+}
+
+/*
+ *  Returns the size of the Voronoi targets: the whole image, or one
+ *  tile and its halo in --tile mode
+ */
+void config_window(const Config* c, uint32_t* width, uint32_t* height)
+{
+    if (!c->tile)
+    {
+        *width = c->width;
+        *height = c->height;
+        return;
+    }
+    const uint32_t halo = config_halo(c);
+    *width = ((c->width < c->tile) ? c->width : c->tile) + 2 * halo;
+    *height = ((c->height < c->tile) ? c->height : c->tile) + 2 * halo;
+}
+
+/*  Bounds on the segments picked for cones and dots  */
+#define SEGMENTS_MIN 16
+#define SEGMENTS_MAX 256
+
+/*
+ *  Returns the number of segments in each cone.  A fan of n segments
+ *  misplaces a cell boundary at distance r by about r * pi^2 / (2 n^2), so
+ *  keeping that under half a pixel needs n >= pi * sqrt(r).  r is taken as
+ *  twice the typical cell radius, since cells in light areas are larger.
+ */
+uint32_t config_cone_segments(const Config* c)
+{
+    if (c->resolution)
+    {
+        return c->resolution;
+    }
+    const double r = 2 * sqrt((double)c->width * c->height / (M_PI * c->seeds));
+    const uint32_t n = ceil(M_PI * sqrt(r));
+    return (n < SEGMENTS_MIN) ? SEGMENTS_MIN
+         : (n > SEGMENTS_MAX) ? SEGMENTS_MAX
+         : n;
+}
+
+/*
+ *  Returns the radius of a full-weight dot, in image pixels
+ */
+float config_dot_radius(const Config* c)
+{
+    return c->radius * fmin(c->sx, c->sy) * fmin(c->width, c->height);
+}
+
+/*
+ *  Returns the density mapping's value (0 to 1) for an 8-bit pixel:
+ *  darkness, or brightness with --invert, raised to the power --gamma
+ */
+float config_density(const Config* c, stbi_uc v)
+{
+    const float d = c->invert ? v / 255.0f : 1.0f - v / 255.0f;
+    return (c->gamma == 1.0f) ? d : powf(d, c->gamma);
+}
+
+/*
+ *  Returns the weight of an 8-bit pixel in the centroid sums, as computed
+ *  by WEIGHT in the shaders.  Every pixel gets a little weight, so that
+ *  cells in empty areas still move.
+ */
+float config_weight(const Config* c, stbi_uc v)
+{
+    return 0.01f + 0.99f * config_density(c, v);
+}
+
+/*
+ *  Fills a table of integer density (0 to 255) for each pixel value,
+ *  used to seed points in proportion to the density mapping
+ */
+void config_density_table(const Config* c, uint32_t table[256])
+{
+    for (unsigned i=0; i < 256; ++i)
+    {
+        table[i] = lroundf(255.0f * config_density(c, i));
+    }
+}
+
+/*
+ *  Writes the #defines that specialize the centroid shaders: WEIGHT is the
+ *  density mapping, and WINDOW_SIZE is the window size if known (when
+ *  width and height are non-zero) or otherwise read from the textures
+ */
+void config_defines(const Config* c, uint32_t width, uint32_t height,
+                    char* out, size_t size)
+{
+    const char* d = c->invert ? "(v)" : "(1.0f - (v))";
+    int n = (c->gamma == 1.0f)
+        ? snprintf(out, size, "#define WEIGHT(v) (0.01f + 0.99f * %s)\n", d)
+        : snprintf(out, size, "#define WEIGHT(v) "
+                              "(0.01f + 0.99f * pow(%s, float(%.9g)))\n",
+                   d, c->gamma);
+    n = (n < 0 || (size_t)n >= size) ? (int)size - 1 : n;
+    if (width && height)
+    {
+        snprintf(out + n, size - n, "#define WINDOW_SIZE ivec2(%u, %u)\n",
+                 width, height);
+    }
+    else
+    {
+        snprintf(out + n, size - n,
+                 "#define WINDOW_SIZE textureSize(voronoi, 0)\n");
+    }
+}
+
+void config_set_aspect_ratio(Config* c)
+{
+    if (c->width > c->height)
+    {
+        c->sx = 1;
+        c->sy = (float)c->width / (float)c->height;
+    }
+    else
+    {
+        c->sx = (float)c->height / (float)c->width;
+        c->sy = 1;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ *  A small, fast PRNG (splitmix64).  Independent streams are cheap to
+ *  create, which lets work be split between threads reproducibly.
+ */
+typedef struct Rng_ {
+    uint64_t state;
+} Rng;
+
+uint64_t rng_next(Rng* r)
+{
+    uint64_t z = (r->state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/*  Returns a uniform double in [0, 1)  */
+double rng_uniform(Rng* r)
+{
+    return (rng_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*  Returns a uniform integer in [0, n)  */
+uint32_t rng_below(Rng* r, uint32_t n)
+{
+    return ((rng_next(r) >> 32) * n) >> 32;
+}
+
+/*
+ *  Returns the given stream of random numbers for a seed
+ */
+Rng rng_stream(uint64_t seed, uint64_t stream)
+{
+    Rng r = {seed ^ (stream * 0xD1B54A32D192ED03ull)};
+    rng_next(&r);
+    return r;
+}
+
+typedef struct ParallelJob_ {
+    void (*fn)(void* data, uint32_t begin, uint32_t end);
+    void* data;
+    uint32_t begin, end;
+} ParallelJob;
+
+void* parallel_worker(void* data)
+{
+    ParallelJob* job = (ParallelJob*)data;
+    job->fn(job->data, job->begin, job->end);
+    return NULL;
+}
+
+/*
+ *  Calls fn over [0, n), split into contiguous ranges across up to
+ *  'threads' threads (including the calling one)
+ */
+void parallel_for(unsigned threads, uint32_t n,
+                  void (*fn)(void* data, uint32_t begin, uint32_t end),
+                  void* data)
+{
+    threads = (threads < n) ? threads : (n ? n : 1);
+    ParallelJob* jobs = (ParallelJob*)calloc(threads, sizeof(ParallelJob));
+    pthread_t* ids = (pthread_t*)calloc(threads, sizeof(pthread_t));
+    for (unsigned i=0; i < threads; ++i)
+    {
+        jobs[i] = (ParallelJob){fn, data, (uint64_t)n * i / threads,
+                                (uint64_t)n * (i + 1) / threads};
+        if (i)
+        {
+            pthread_create(&ids[i], NULL, parallel_worker, &jobs[i]);
+        }
+    }
+    parallel_worker(&jobs[0]);
+    for (unsigned i=1; i < threads; ++i)
+    {
+        pthread_join(ids[i], NULL);
+    }
+    free(ids);
+    free(jobs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*  Cell indices are stored in an R32UI texture, but jump flooding carries
+ *  them through float seeds, which are only exact up to 2^24  */
+#define VORONOI_MAX_SAMPLES (1u << 24)
+
+/*  Images up to this size use a 16-bit depth buffer  */
+#define VORONOI_DEPTH16_MAX 4096
+
+typedef struct Voronoi_ {
+    GLuint vao;     /*  VAO with bound cone and offsets */
+    GLuint cone;    /*  VBO containing the cone (or quad)   */
+    GLuint cone_verts;      /*  Vertices in the cone VBO    */
+    uint32_t segments;      /*  Segments in the cone VBO, or 0 for a quad */
+    GLuint pts;     /*  VBO containing point locations  */
+    GLuint prog;    /*  Shader program (compiled)       */
+    GLuint img;     /*  Target image texture            */
+    GLuint upload[2];       /*  Pixel unpack buffers for img, used in turn */
+    unsigned uploads;       /*  Number of uploads so far    */
+
+    GLuint tex;     /*  R32UI cell indices (bound to fbo)   */
+    GLuint depth;   /*  Depth renderbuffer (bound to fbo)   */
+    bool invalidate;        /*  glInvalidateFramebuffer is available    */
+    GLuint fbo;     /*  Framebuffer for render-to-texture   */
+
+    uint32_t width, height; /*  Size of the allocated textures  */
+    uint32_t samples;       /*  Size of the allocated point VBO */
+
+    /*  Jump flooding state (only used by VORONOI_JFA)  */
+    GLuint jfa_vao;         /*  VAO with points bound as vertices   */
+    GLuint jfa_quad;        /*  Quad for full-screen passes         */
+    GLuint jfa_seed_prog;
+    GLuint jfa_step_prog;
+    GLuint jfa_encode_prog;
+    GLuint jfa_tex[2];      /*  Ping-pong seed textures             */
+    GLuint jfa_fbo[2];
+
+    /*  Uniform locations for the per-window and per-pass values  */
+    GLint origin_loc;
+    GLint jfa_origin_loc;
+    GLint jfa_step_loc;
+} Voronoi;
+
+/*
+ *  Builds the (empty) vertex buffer for the cone, binding it to vertex
+ *  attribute slot 0.  Must be called with a bound VAO.
+ */
+GLuint voronoi_cone_bind()
+{
+    GLuint vbo;
+    glGenBuffers(1, &vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    return vbo;
+}
+
+/*
+ *  Fills the cone VBO with a fan of n segments, or with a single quad if
+ *  n is 0, recording its vertex count
+ */
+void voronoi_cone_fill(Voronoi* v, uint32_t n)
+{
+    const uint32_t verts = n ? n + 2 : 4;
+    size_t bytes = verts * 3 * sizeof(float);
+    float* buf = (float*)malloc(bytes);
+
+    if (n)
+    {
+        /* This is the tip of the cone */
+        buf[0] = 0;
+        buf[1] = 0;
+        buf[2] = -1;
+
+        for (uint32_t i=0; i <= n; ++i)
+        {
+            float angle = 2 * M_PI * i / n;
+            buf[i*3 + 3] = cos(angle);
+            buf[i*3 + 4] = sin(angle);
+            buf[i*3 + 5] = 1;
+        }
+    }
+    else
+    {
+        const float quad[12] = {-1, -1, 0,   1, -1, 0,   1, 1, 0,   -1, 1, 0};
+        memcpy(buf, quad, sizeof(quad));
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, v->cone);
+    glBufferData(GL_ARRAY_BUFFER, bytes, buf, GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    free(buf);
+
+    v->cone_verts = verts;
+    v->segments = n;
+}
+
+/*  Seeding draws points in chunks of this many, each chunk from its own
+ *  random stream, so that results don't depend on the thread count  */
+#define SEED_CHUNK 4096
+
+typedef struct SeedJob_ {
+    const Config* c;
+    uint32_t density[256];  /*  From config_density_table  */
+    uint32_t* cdf;      /*  Running density along each row  */
+    double* rows;       /*  Density of all rows before each row (height + 1) */
+    float* buf;
+} SeedJob;
+
+void seed_rows(void* data, uint32_t y0, uint32_t y1)
+{
+    SeedJob* job = (SeedJob*)data;
+    const uint32_t w = job->c->width;
+    for (uint32_t y=y0; y < y1; ++y)
+    {
+        const stbi_uc* in = job->c->img + (size_t)y*w;
+        uint32_t* out = job->cdf + (size_t)y*w;
+        uint32_t sum = 0;
+        for (uint32_t x=0; x < w; ++x)
+        {
+            sum += job->density[in[x]];
+            out[x] = sum;
+        }
+        job->rows[y + 1] = sum;
+    }
+}
+
+/*
+ *  Returns the pixel found u of the way along the density of a w x h
+ *  image, given the running density along each row (cdf) and the density
+ *  of all rows before each row (rows): the row first, then the pixel
+ *  within the row
+ */
+void seed_pick(const uint32_t* cdf, const double* rows, uint32_t w,
+               uint32_t h, double u, uint32_t* x, uint32_t* y)
+{
+    uint32_t lo = 0;
+    uint32_t hi = h;
+    while (hi - lo > 1)
+    {
+        const uint32_t mid = (lo + hi) / 2;
+        if (rows[mid] <= u)     lo = mid;
+        else                    hi = mid;
+    }
+    *y = lo;
+
+    const uint32_t* row = cdf + (size_t)lo*w;
+    const double v = u - rows[lo];
+    lo = 0;
+    hi = w - 1;
+    while (lo < hi)
+    {
+        const uint32_t mid = (lo + hi) / 2;
+        if (row[mid] <= v)      lo = mid + 1;
+        else                    hi = mid;
+    }
+    *x = lo;
+}
+
+void seed_chunks(void* data, uint32_t k0, uint32_t k1)
+{
+    SeedJob* job = (SeedJob*)data;
+    const Config* c = job->c;
+    const double total = job->rows[c->height];
+
+    for (uint32_t k=k0; k < k1; ++k)
+    {
+        Rng r = rng_stream(c->seed, k);
+        const uint32_t end = ((uint64_t)k + 1) * SEED_CHUNK < c->samples
+                           ? (k + 1) * SEED_CHUNK : c->samples;
+        for (uint32_t i=k * SEED_CHUNK; i < end; ++i)
+        {
+            uint32_t x, y;
+            if (total == 0)     /*  A blank image gets uniform points   */
+            {
+                x = rng_below(&r, c->width);
+                y = rng_below(&r, c->height);
+            }
+            else
+            {
+                seed_pick(job->cdf, job->rows, c->width, c->height,
+                          rng_uniform(&r) * total, &x, &y);
+            }
+
+            job->buf[3*i]     = (x + rng_uniform(&r)) / c->width;
+            job->buf[3*i + 1] = (y + rng_uniform(&r)) / c->height;
+            job->buf[3*i + 2] = 0.0f;
+        }
+    }
+}
+
+/*
+ *  Fills buf with samples points between 0 and 1, distributed by the
+ *  image's density (see config_density).  Points are drawn by inverse
+ *  transform sampling from row prefix sums (so each costs two binary
+ *  searches, however bright the image is) using cfg->seed, in parallel
+ *  over cfg->threads threads.
+ */
+void voronoi_seed(const Config* c, float* buf)
+{
+    SeedJob job = {
+        .c = c,
+        .cdf = (uint32_t*)malloc((size_t)c->width * c->height *
+                                 sizeof(uint32_t)),
+        .rows = (double*)calloc(c->height + 1, sizeof(double)),
+        .buf = buf};
+    config_density_table(c, job.density);
+
+    parallel_for(c->threads, c->height, seed_rows, &job);
+    for (uint32_t y=0; y < c->height; ++y)
+    {
+        job.rows[y + 1] += job.rows[y];
+    }
+    parallel_for(c->threads, (c->samples + SEED_CHUNK - 1) / SEED_CHUNK,
+                 seed_chunks, &job);
+
+    free(job.cdf);
+    free(job.rows);
+}
+
+/*
+ *  Seeds points like voronoi_seed for an image streamed from disk: each
+ *  tile's share of the points is drawn in proportion to its density, then
+ *  the points are placed by inverse transform sampling from the tile's
+ *  own row prefix sums, built as it's read back in.  Only one tile's
+ *  sums are held at a time.  Returns false if the image couldn't be read.
+ */
+bool voronoi_seed_tiled(const Config* c, float* buf)
+{
+    const uint32_t t = c->tile;
+    const uint32_t nx = (c->width + t - 1) / t;
+    const uint32_t ny = (c->height + t - 1) / t;
+    const uint32_t n = nx * ny;
+
+    /*  Cumulative density of the tiles, in row-major order  */
+    double* mass = (double*)calloc(n + 1, sizeof(double));
+    uint32_t* counts = (uint32_t*)calloc(n, sizeof(uint32_t));
+    stbi_uc* tile = (stbi_uc*)malloc((size_t)t * t);
+    uint32_t* cdf = (uint32_t*)malloc((size_t)t * t * sizeof(uint32_t));
+    double* rows = (double*)calloc(t + 1, sizeof(double));
+    uint32_t density[256];
+    config_density_table(c, density);
+    bool ok = true;
+    Rng rng = rng_stream(c->seed, 0);
+
+    for (uint32_t i=0; ok && i < n; ++i)
+    {
+        const uint32_t x0 = (i % nx) * t;
+        const uint32_t y0 = (i / nx) * t;
+        const uint32_t w = (c->width - x0 < t) ? c->width - x0 : t;
+        const uint32_t h = (c->height - y0 < t) ? c->height - y0 : t;
+        ok = tile_source_read(c->source, x0, y0, t, t, tile);
+
+        /*  Only pixels within the image count, not the tile's padding  */
+        uint64_t dark = 0;
+        for (uint32_t y=0; y < h; ++y)
+        {
+            for (uint32_t x=0; x < w; ++x)
+            {
+                dark += density[tile[(size_t)y*t + x]];
+            }
+        }
+        mass[i + 1] = mass[i] + dark;
+    }
+
+    /*  A blank image gets uniformly distributed points  */
+    const bool blank = mass[n] == 0;
+    for (uint32_t i=0; blank && i <= n; ++i)
+    {
+        mass[i] = i;
+    }
+
+    for (uint32_t i=0; ok && i < c->samples; ++i)
+    {
+        const double r = rng_uniform(&rng) * mass[n];
+        uint32_t lo = 0;
+        uint32_t hi = n;
+        while (hi - lo > 1)
+        {
+            const uint32_t mid = (lo + hi) / 2;
+            if (mass[mid] <= r)     lo = mid;
+            else                    hi = mid;
+        }
+        counts[lo]++;
+    }
+
+    uint32_t i = 0;
+    for (uint32_t k=0; ok && k < n; ++k)
+    {
+        if (!counts[k])
+        {
+            continue;
+        }
+        const uint32_t x0 = (k % nx) * t;
+        const uint32_t y0 = (k / nx) * t;
+        const uint32_t w = (c->width - x0 < t) ? c->width - x0 : t;
+        const uint32_t h = (c->height - y0 < t) ? c->height - y0 : t;
+        ok = tile_source_read(c->source, x0, y0, t, t, tile);
+
+        /*  Row prefix sums over the tile's pixels within the image, as
+         *  in seed_rows (but packed w pixels to a row)  */
+        for (uint32_t y=0; ok && y < h; ++y)
+        {
+            uint32_t sum = 0;
+            for (uint32_t x=0; x < w; ++x)
+            {
+                sum += density[tile[(size_t)y*t + x]];
+                cdf[(size_t)y*w + x] = sum;
+            }
+            rows[y + 1] = rows[y] + sum;
+        }
+
+        for (uint32_t placed=0; ok && placed < counts[k]; ++placed, ++i)
+        {
+            uint32_t x, y;
+            if (blank)
+            {
+                x = rng_below(&rng, w);
+                y = rng_below(&rng, h);
+            }
+            else
+            {
+                seed_pick(cdf, rows, w, h, rng_uniform(&rng) * rows[h],
+                          &x, &y);
+            }
+            buf[3*i]     = (x0 + x + rng_uniform(&rng)) / c->width;
+            buf[3*i + 1] = (y0 + y + rng_uniform(&rng)) / c->height;
+            buf[3*i + 2] = 0.0f;
+        }
+    }
+
+    free(rows);
+    free(cdf);
+    free(tile);
+    free(counts);
+    free(mass);
+    return ok;
+}
+
+/*
+ *  Builds and returns the (empty) VBO for cone instances, binding it to
+ *  vertex attribute slot 1
+ */
+GLuint voronoi_instances()
+{
+    GLuint vbo;
+    glGenBuffers(1, &vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    glVertexAttribDivisor(1, 1);
+
+    return vbo;
+}
+
+/*
+ *  Builds the VAO and programs used for jump flooding
+ */
+void voronoi_jfa_new(Voronoi* v)
+{
+    glGenVertexArrays(1, &v->jfa_vao);
+    glBindVertexArray(v->jfa_vao);
+        glBindBuffer(GL_ARRAY_BUFFER, v->pts);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    glBindVertexArray(0);
+
+    v->jfa_quad = quad_new();
+
+    for (unsigned i=0; i < 2; ++i)
+    {
+        v->jfa_tex[i] = texture_new();
+        glGenFramebuffers(1, &v->jfa_fbo[i]);
+    }
+
+    v->jfa_seed_prog = program_new(jfa_seed_vert_src, jfa_seed_frag_src);
+    v->jfa_step_prog = program_new(quad_vert_src, jfa_step_frag_src);
+    v->jfa_encode_prog = program_new(quad_vert_src, jfa_encode_frag_src);
+
+    v->jfa_origin_loc = glGetUniformLocation(v->jfa_seed_prog, "origin");
+    v->jfa_step_loc = glGetUniformLocation(v->jfa_step_prog, "step");
+    glUseProgram(v->jfa_step_prog);
+    glUniform1i(glGetUniformLocation(v->jfa_step_prog, "seeds"), 0);
+    glUseProgram(v->jfa_encode_prog);
+    glUniform1i(glGetUniformLocation(v->jfa_encode_prog, "seeds"), 0);
+}
+
+/*
+ *  (Re)allocates every image-sized texture at the given window size
+ */
+void voronoi_resize(const Config* cfg, Voronoi* v,
+                    uint32_t width, uint32_t height)
+{
+    glBindTexture(GL_TEXTURE_2D, v->tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, width, height,
+                 0, GL_RED_INTEGER, GL_UNSIGNED_INT, 0);
+
+    /*  Cone depth runs from 0 to 1 over half the image's longer side, so
+     *  16 bits resolve 1/32 pixel up to VORONOI_DEPTH16_MAX pixels  */
+    const uint32_t size = (cfg->width > cfg->height) ? cfg->width
+                                                     : cfg->height;
+    glBindRenderbuffer(GL_RENDERBUFFER, v->depth);
+    glRenderbufferStorage(GL_RENDERBUFFER,
+                          (size <= VORONOI_DEPTH16_MAX) ? GL_DEPTH_COMPONENT16
+                                                        : GL_DEPTH_COMPONENT24,
+                          width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glBindTexture(GL_TEXTURE_2D, v->img);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, width, height,
+                 0, GL_RED, GL_UNSIGNED_BYTE, 0);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, v->fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, v->tex, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                              GL_RENDERBUFFER, v->depth);
+    fbo_check("voronoi");
+
+    if (cfg->voronoi == VORONOI_JFA)
+    {
+        for (unsigned i=0; i < 2; ++i)
+        {
+            glBindTexture(GL_TEXTURE_2D, v->jfa_tex[i]);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F,
+                         width, height, 0, GL_RGBA, GL_FLOAT, 0);
+
+            glBindFramebuffer(GL_FRAMEBUFFER, v->jfa_fbo[i]);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                   GL_TEXTURE_2D, v->jfa_tex[i], 0);
+            fbo_check("jfa");
+        }
+    }
+
+    v->width = width;
+    v->height = height;
+}
+
+/*
+ *  Uploads one window's worth of 8-bit pixels into the image texture.
+ *  The pixels are staged in a pixel unpack buffer, so this returns once
+ *  they're copied and the texture is updated in order with the GPU's
+ *  other work; alternating between two buffers keeps a new upload from
+ *  waiting on the last one.
+ */
+void voronoi_upload(Voronoi* v, const stbi_uc* pixels)
+{
+    const size_t bytes = (size_t)v->width * v->height;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, v->upload[v->uploads++ % 2]);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, pixels, GL_STREAM_DRAW);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glBindTexture(GL_TEXTURE_2D, v->img);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, v->width, v->height,
+                    GL_RED, GL_UNSIGNED_BYTE, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+Voronoi* voronoi_new(const Config* cfg)
+{
+    Voronoi* v = (Voronoi*)calloc(1, sizeof(Voronoi));
+    glGenVertexArrays(1, &v->vao);
+
+    glBindVertexArray(v->vao);
+        v->cone = voronoi_cone_bind();              /* Uses bound VAO   */
+        v->pts = voronoi_instances();               /* (same) */
+    glBindVertexArray(0);
+    v->segments = (uint32_t)-1;     /*  Filled in by voronoi_load  */
+
+    v->prog = program_new(voronoi_vert_src, (cfg->cone == CONE_QUAD)
+                                ? voronoi_quad_frag_src : voronoi_frag_src);
+    v->origin_loc = glGetUniformLocation(v->prog, "origin");
+
+    v->tex   = texture_new();
+    v->img   = texture_new();
+    glGenRenderbuffers(1, &v->depth);
+    v->invalidate = epoxy_gl_version() >= 43 ||
+                    epoxy_has_gl_extension("GL_ARB_invalidate_subdata");
+    glGenBuffers(2, v->upload);
+    glGenFramebuffers(1, &v->fbo);
+
+    if (cfg->voronoi == VORONOI_JFA)
+    {
+        voronoi_jfa_new(v);
+    }
+
+    state_reset();
+    return v;
+}
+
+/*
+ *  Sets the uniforms that stay fixed while relaxing a given image
+ */
+void voronoi_uniforms(const Config* cfg, Voronoi* v)
+{
+    glUseProgram(v->prog);
+    glUniform2f(glGetUniformLocation(v->prog, "scale"), cfg->sx, cfg->sy);
+    glUniform2f(glGetUniformLocation(v->prog, "window"), v->width, v->height);
+    glUniform2f(glGetUniformLocation(v->prog, "image"),
+                cfg->width, cfg->height);
+
+    if (cfg->voronoi == VORONOI_JFA)
+    {
+        glUseProgram(v->jfa_seed_prog);
+        glUniform2f(glGetUniformLocation(v->jfa_seed_prog, "size"),
+                    v->width, v->height);
+        glUniform2f(glGetUniformLocation(v->jfa_seed_prog, "image"),
+                    cfg->width, cfg->height);
+    }
+}
+
+/*
+ *  Prepares the Voronoi stage for a new image: textures and the point
+ *  buffer are only reallocated if the window size or sample count changed,
+ *  then the image is uploaded (unless it's streamed in --tile mode).
+ *  If 'seed' is set, the points are reseeded
+ *  (or loaded from cfg->start); otherwise the current points are kept and
+ *  the sample count must not have changed.
+ */
+bool voronoi_load(const Config* cfg, Voronoi* v, bool seed)
+{
+    uint32_t width, height;
+    config_window(cfg, &width, &height);
+
+    GLint max_size;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    if (width > (GLuint)max_size || height > (GLuint)max_size)
+    {
+        fprintf(stderr, "Error: %s is too large (%u x %u, limit is %i)%s\n",
+                cfg->tile ? "tile" : "image", width, height, max_size,
+                cfg->tile ? "" : "; try --tile");
+        return false;
+    }
+
+    if (width != v->width || height != v->height)
+    {
+        voronoi_resize(cfg, v, width, height);
+    }
+
+    const uint32_t segments = (cfg->cone == CONE_QUAD)
+        ? 0 : config_cone_segments(cfg);
+    if (segments != v->segments)
+    {
+        voronoi_cone_fill(v, segments);
+    }
+
+    if (cfg->img)
+    {
+        voronoi_upload(v, cfg->img);
+    }
+    voronoi_uniforms(cfg, v);
+
+    if (!seed)
+    {
+        assert(cfg->samples == v->samples);
+        state_reset();
+        return true;
+    }
+
+    size_t bytes = cfg->samples * 3 * sizeof(float);
+    glBindBuffer(GL_ARRAY_BUFFER, v->pts);
+    if (cfg->samples != v->samples)
+    {
+        glBufferData(GL_ARRAY_BUFFER, bytes, NULL, GL_DYNAMIC_DRAW);
+        v->samples = cfg->samples;
+    }
+
+    bool ok = true;
+    if (cfg->start)
+    {
+        glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, cfg->start);
+    }
+    else
+    {
+        /*  Spare capacity in --adaptive mode starts out dead  */
+        float* buf = (float*)malloc(bytes);
+        Config seeded = *cfg;
+        seeded.samples = cfg->seeds;
+        if (cfg->source)
+        {
+            ok = voronoi_seed_tiled(&seeded, buf);
+        }
+        else
+        {
+            voronoi_seed(&seeded, buf);
+        }
+        for (uint32_t i=cfg->seeds; i < cfg->samples; ++i)
+        {
+            buf[3*i] = 0.0f;
+            buf[3*i + 1] = 0.0f;
+            buf[3*i + 2] = -1.0f;
+        }
+        glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, buf);
+        free(buf);
+    }
+
+    state_reset();
+    return ok;
+}
+
+/*
+ *  Builds the cell-index image with the jump flooding algorithm: seeds are
+ *  splatted at each point, then propagated with steps of N/2, N/4, ... 1
+ */
+void voronoi_draw_jfa(Config* cfg, Voronoi* v, const Window* w)
+{
+    state_depth_test(false);
+    state_blend(0);
+
+    /*  Seed pass: empty pixels are marked with w = 0  */
+    state_framebuffer(v->jfa_fbo[0], v->width, v->height);
+    const GLfloat zero[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    glClearBufferfv(GL_COLOR, 0, zero);
+
+    state_program(v->jfa_seed_prog);
+    state_vao(v->jfa_vao);
+    glUniform2f(v->jfa_origin_loc, w->x, w->y);
+    glDrawArrays(GL_POINTS, 0, cfg->samples);
+
+    /*  Flood passes, ping-ponging between the two seed textures  */
+    state_program(v->jfa_step_prog);
+    state_vao(v->jfa_quad);
+    glActiveTexture(GL_TEXTURE0);
+
+    unsigned src = 0;
+    unsigned step = 1;
+    while (step * 2 < (v->width > v->height ? v->width : v->height))
+    {
+        step *= 2;
+    }
+    for (; step >= 1; step /= 2)
+    {
+        state_framebuffer(v->jfa_fbo[!src], v->width, v->height);
+        glBindTexture(GL_TEXTURE_2D, v->jfa_tex[src]);
+        glUniform1i(v->jfa_step_loc, step);
+        glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+        src = !src;
+    }
+
+    /*  Write the seed indices into the usual Voronoi texture  */
+    state_framebuffer(v->fbo, v->width, v->height);
+    state_program(v->jfa_encode_prog);
+    glBindTexture(GL_TEXTURE_2D, v->jfa_tex[src]);
+    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+}
+
+/*
+ *  Renders the cell-index image for one window of the image into v->tex
+ */
+void voronoi_draw(Config* cfg, Voronoi* v, const Window* w)
+{
+    if (cfg->voronoi == VORONOI_JFA)
+    {
+        voronoi_draw_jfa(cfg, v, w);
+        return;
+    }
+
+    /*  Cones reach half the image's longer side, so with points spread
+     *  over the image every pixel is written and only depth is cleared  */
+    state_framebuffer(v->fbo, v->width, v->height);
+    state_depth_test(true);
+    state_blend(0);
+    glClear(GL_DEPTH_BUFFER_BIT);
+
+    state_program(v->prog);
+    state_vao(v->vao);
+    glUniform2f(v->origin_loc, w->x, w->y);
+    glDrawArraysInstanced(GL_TRIANGLE_FAN, 0, v->cone_verts, cfg->samples);
+
+    /*  Depth is never read back, so tiled GPUs needn't store it  */
+    if (v->invalidate)
+    {
+        const GLenum depth = GL_DEPTH_ATTACHMENT;
+        glInvalidateFramebuffer(GL_FRAMEBUFFER, 1, &depth);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*  Each reduction pass collapses this many rows of partial sums into one  */
+#define SUM_REDUCE_FACTOR   16
+#define SUM_MAX_LEVELS      8
+
+typedef struct Sum_
+{
+    CentroidEngine engine;
+    SumFormat format;   /*  Of tex; reduction levels are always RGBA32F  */
+    GLuint prog;
+    GLuint fbo;
+    GLuint tex;
+    GLuint vao;     /*  Quad (rows) or attribute-less VAO (scatter) */
+    GLuint samples; /*  Number of cells the texture is sized for  */
+
+    /*  Cells are wrapped into a 2D layout so that large sample counts fit
+     *  within GL_MAX_TEXTURE_SIZE: cell i is in column i % cols of block
+     *  i / cols, and each block is rows texels tall.  */
+    GLuint cols;
+    GLuint blocks;
+    GLuint rows;
+
+    /*  Tree reduction from rows down to a single row of totals per block  */
+    GLuint quad;
+    GLuint reduce_prog;
+    GLuint levels;
+    GLuint level_tex[SUM_MAX_LEVELS];
+    GLuint level_fbo[SUM_MAX_LEVELS];
+    GLuint level_rows[SUM_MAX_LEVELS];
+
+    GLuint out;     /*  One texel per cell; either tex or the last level  */
+
+    /*  Window size built into the rows program, or 0 x 0 for scatter  */
+    uint32_t variant_width, variant_height;
+
+    /*  Uniform locations for the per-window and per-pass values  */
+    GLint origin_loc;
+    GLint owned_loc;
+    GLint in_rows_loc;
+    GLint out_rows_loc;
+} Sum;
+
+/*
+ *  (Re)allocates the storage of a texture attached to a framebuffer,
+ *  returning true if the result is renderable
+ */
+bool sum_target(GLuint tex, GLuint fbo, GLint format,
+                GLuint width, GLuint height)
+{
+    glBindTexture(GL_TEXTURE_2D, tex);
+        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height,
+                     0, GL_RGBA, GL_FLOAT, 0);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, tex, 0);
+    return glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+}
+
+/*
+ *  Builds the chain of reduction targets, each SUM_REDUCE_FACTOR times
+ *  shorter than the last, ending with a single row per block.  Targets
+ *  and the reduction program are kept around when the chain is rebuilt.
+ */
+void sum_levels_resize(Sum* sum)
+{
+    GLuint rows = sum->rows;
+    sum->out = sum->tex;
+    sum->levels = 0;
+    while (rows > 1)
+    {
+        assert(sum->levels < SUM_MAX_LEVELS);
+        rows = (rows + SUM_REDUCE_FACTOR - 1) / SUM_REDUCE_FACTOR;
+
+        const GLuint i = sum->levels++;
+        if (!sum->level_tex[i])
+        {
+            sum->level_tex[i] = texture_new();
+            glGenFramebuffers(1, &sum->level_fbo[i]);
+        }
+        sum->level_rows[i] = rows;
+        sum_target(sum->level_tex[i], sum->level_fbo[i], GL_RGBA32F,
+                   sum->cols, sum->blocks * rows);
+        fbo_check("reduction");
+        sum->out = sum->level_tex[i];
+    }
+
+    if (sum->levels && !sum->reduce_prog)
+    {
+        sum->quad = quad_new();
+        sum->reduce_prog = program_new(quad_vert_src, reduce_frag_src);
+
+        sum->in_rows_loc = glGetUniformLocation(sum->reduce_prog, "in_rows");
+        sum->out_rows_loc = glGetUniformLocation(sum->reduce_prog, "out_rows");
+        glUseProgram(sum->reduce_prog);
+        glUniform1i(glGetUniformLocation(sum->reduce_prog, "summed"), 0);
+        glUniform1i(glGetUniformLocation(sum->reduce_prog, "factor"),
+                    SUM_REDUCE_FACTOR);
+    }
+}
+
+/*
+ *  Runs the reduction passes, leaving per-cell totals in s->out
+ */
+void sum_reduce(Sum* s)
+{
+    state_blend(0);
+    state_program(s->reduce_prog);
+    state_vao(s->quad);
+    glActiveTexture(GL_TEXTURE0);
+
+    GLuint src = s->tex;
+    GLuint src_rows = s->rows;
+    for (GLuint i=0; i < s->levels; ++i)
+    {
+        state_framebuffer(s->level_fbo[i], s->cols,
+                          s->blocks * s->level_rows[i]);
+        glBindTexture(GL_TEXTURE_2D, src);
+        glUniform1i(s->in_rows_loc, src_rows);
+        glUniform1i(s->out_rows_loc, s->level_rows[i]);
+        glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+        src = s->level_tex[i];
+        src_rows = s->level_rows[i];
+    }
+}
+
+/*
+ *  Returns the bytes held by the Sum texture and its reduction chain;
+ *  each is written once and read once per iteration
+ */
+uint64_t sum_bytes(const Sum* s)
+{
+    uint64_t bytes = (uint64_t)s->cols * s->blocks * s->rows *
+                     sum_format_bytes[s->format];
+    for (GLuint i=0; i < s->levels; ++i)
+    {
+        bytes += (uint64_t)s->cols * s->blocks * s->level_rows[i] *
+                 sum_format_bytes[SUM_RGBA32F];
+    }
+    return bytes;
+}
+
+Sum* sum_new(Config* config)
+{
+    Sum* sum = (Sum*)calloc(1, sizeof(Sum));
+    sum->engine = config->centroid;
+    sum->format = config->sum_format;
+    sum->tex = texture_new();
+    glGenFramebuffers(1, &sum->fbo);
+
+    if (sum->engine == CENTROID_SCATTER)
+    {
+        /*  Scattering needs additive blending into a float target; if the
+         *  driver can't render to one, use the row-walking reduction   */
+        if (sum_target(sum->tex, sum->fbo, GL_RGBA32F, 1, 1))
+        {
+            glGenVertexArrays(1, &sum->vao);
+        }
+        else
+        {
+            fprintf(stderr, "Warning: float render targets are unsupported;"
+                            " falling back to row-walking centroids\n");
+            sum->engine = CENTROID_ROWS;
+        }
+        config->centroid = sum->engine;
+    }
+
+    if (sum->engine == CENTROID_ROWS)
+    {
+        sum->vao = quad_new();
+    }
+
+    state_reset();
+    return sum;
+}
+
+/*
+ *  Builds the accumulation program for this weighting (and, for the rows
+ *  engine, this window size) if it doesn't match the current one.  The
+ *  rows engine walks a whole window row per fragment, so its loop gets a
+ *  constant trip count; scatter reads the size once per pixel, so it
+ *  keeps one program for every size.
+ */
+void sum_program(const Config* cfg, Sum* s)
+{
+    const bool rows = s->engine == CENTROID_ROWS;
+    const uint32_t width = rows ? cfg->width : 0;
+    const uint32_t height = rows ? cfg->height : 0;
+    if (s->prog && width == s->variant_width && height == s->variant_height)
+    {
+        return;
+    }
+
+    char defines[256];
+    config_defines(cfg, width, height, defines, sizeof(defines));
+    glDeleteProgram(s->prog);
+    s->prog = rows
+        ? program_build(defines, quad_vert_src, NULL, sum_frag_src, 0, NULL)
+        : program_build(defines, scatter_vert_src, NULL, scatter_frag_src,
+                        0, NULL);
+    s->variant_width = width;
+    s->variant_height = height;
+
+    s->origin_loc = glGetUniformLocation(s->prog, "origin");
+    s->owned_loc = glGetUniformLocation(s->prog, "owned");
+    glUseProgram(s->prog);
+    glUniform1i(glGetUniformLocation(s->prog, "voronoi"), 0);
+    glUniform1i(glGetUniformLocation(s->prog, "img"), 1);
+}
+
+/*
+ *  Sets the uniforms that depend on the layout and image size
+ */
+void sum_uniforms(const Config* cfg, Sum* s)
+{
+    glUseProgram(s->prog);
+    glUniform1i(glGetUniformLocation(s->prog, "cols"), s->cols);
+    if (s->engine == CENTROID_SCATTER)
+    {
+        glUniform2f(glGetUniformLocation(s->prog, "target"),
+                    s->cols, s->blocks);
+        glUniform2f(glGetUniformLocation(s->prog, "image"),
+                    cfg->width, cfg->height);
+    }
+    state_reset();
+}
+
+/*
+ *  (Re)allocates the Sum texture and reduction chain if the sample count
+ *  or (for the rows engine) the image height changed, rebuilds the program
+ *  if needed, and sets the uniforms that stay fixed for this image.
+ *  Returns false if the layout doesn't fit in a texture.
+ */
+bool sum_resize(const Config* cfg, Sum* s)
+{
+    if (cfg->tile && s->engine != CENTROID_SCATTER)
+    {
+        fprintf(stderr, "Error: --tile needs float render targets for the "
+                        "scatter centroid engine\n");
+        return false;
+    }
+    if (s->format == SUM_RGBA16F && cfg->width > SUM_HALF_MAX_WIDTH)
+    {
+        fprintf(stderr, "Error: %u pixel rows are too wide for --sum-format "
+                        "rgba16f (limit is %u)\n",
+                cfg->width, SUM_HALF_MAX_WIDTH);
+        return false;
+    }
+    sum_program(cfg, s);
+
+    const GLuint rows = (s->engine == CENTROID_ROWS) ? cfg->height : 1;
+    if (cfg->samples == s->samples && rows == s->rows)
+    {
+        sum_uniforms(cfg, s);
+        return true;
+    }
+
+    GLint max_size;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    const GLuint cols = cfg->samples < (GLuint)max_size ? cfg->samples
+                                                        : (GLuint)max_size;
+    const GLuint blocks = (cfg->samples + cols - 1) / cols;
+    if ((uint64_t)blocks * rows > (uint64_t)max_size)
+    {
+        fprintf(stderr, "Error: %u samples x %u rows don't fit in a %i x %i "
+                        "Sum texture (try --centroid scatter)\n",
+                cfg->samples, rows, max_size, max_size);
+        return false;
+    }
+
+    s->samples = cfg->samples;
+    s->cols = cols;
+    s->blocks = blocks;
+    s->rows = rows;
+    sum_target(s->tex, s->fbo, sum_format_gl[s->format],
+               s->cols, s->blocks * s->rows);
+    fbo_check("sum");
+    sum_levels_resize(s);
+    sum_uniforms(cfg, s);
+    return true;
+}
+
+/*
+ *  Accumulates one window's pixels into the per-cell sums.  Windows after
+ *  the first (with 'clear' unset) add to the sums so far; 'last' runs the
+ *  reduction once every window is in.
+ */
+void sum_draw(Voronoi* v, Sum* s, const Window* w, bool clear, bool last)
+{
+    state_framebuffer(s->fbo, s->cols, s->blocks * s->rows);
+
+    /*  The global clear color has alpha = 1, which would leak into the
+     *  scattered weight sums, so clear this target explicitly   */
+    if (clear)
+    {
+        const GLfloat zero[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        glClearBufferfv(GL_COLOR, 0, zero);
+    }
+
+    state_program(s->prog);
+    state_vao(s->vao);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, v->tex);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, v->img);
+
+    if (s->engine == CENTROID_SCATTER)
+    {
+        /*  Every pixel of the Voronoi image lands once on its cell's texel */
+        glUniform2f(s->origin_loc, w->x, w->y);
+        glUniform4i(s->owned_loc, w->x0, w->y0, w->x1, w->y1);
+        state_blend(GL_FUNC_ADD);
+        glDrawArrays(GL_POINTS, 0, v->width * v->height);
+    }
+    else
+    {
+        state_blend(0);
+        glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+    }
+
+    if (last && s->levels)
+    {
+        sum_reduce(s);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*  In --adaptive mode, cells are split above (1 + h/2) and removed below
+ *  (1 - h/2) times the target mass.  h >= 2/3 keeps the halves of a split
+ *  cell from being removed straight away.  */
+#define ADAPTIVE_HYSTERESIS 0.8f
+
+/*  Pixels in the statistics target: max and total displacement,
+ *  live points and total weight  */
+#define STATS_WIDTH 4
+
+typedef struct Feedback_
+{
+    GLuint vao;
+    GLuint prog;
+
+    GLuint indices; /*  Cell indices, one per point                 */
+    GLuint samples; /*  Number of points the buffers are sized for  */
+
+    GLuint prev;    /*  Copy of the points from before the update   */
+    GLuint delta;   /*  Per-point displacement (one float each)     */
+
+    /*  Split-and-remove program (only used in --adaptive mode), which
+     *  writes a variable number of points over copies of the blank
+     *  buffers, leaving the unused tail dead  */
+    GLuint adapt;
+    GLuint blank;       /*  Dead points, (0, 0, -1) each    */
+    GLuint blank_delta; /*  -1 for every point              */
+    GLint frame_loc;
+    int frame;
+
+    /*  Reduces delta into a 2 x 1 target holding (max, sum)  */
+    GLuint stats_vao;
+    GLuint stats_prog;
+    GLuint stats_tex;
+    GLuint stats_fbo;
+    GLint stats_target_loc;
+    GLint stats_channel_loc;
+} Feedback;
+
+/*
+ *  Fills the bound array buffer with the indices 0, 1, ... samples - 1
+ */
+void feedback_indices(uint32_t samples)
+{
+    size_t bytes = sizeof(GLuint) * samples;
+    GLuint* indices = (GLuint*)malloc(bytes);
+
+    for (uint32_t i=0; i < samples; ++i)
+    {
+        indices[i] = i;
+    }
+    glBufferData(GL_ARRAY_BUFFER, bytes, indices, GL_STATIC_DRAW);
+
+    free(indices);
+}
+
+/*
+ *  Links a transform feedback program that captures the two named
+ *  outputs, from the geometry shader if one is given
+ */
+GLuint feedback_program(const char* geom_src, const GLchar* pos,
+                        const GLchar* delta)
+{
+    const GLchar* varying[] = { pos, delta };
+    GLuint prog = program_build(NULL, feedback_src, geom_src, NULL,
+                                2, varying);
+
+    glUseProgram(prog);
+    glUniform1i(glGetUniformLocation(prog, "summed"), 0);
+    return prog;
+}
+
+Feedback* feedback_new(const Config* cfg, const Voronoi* v)
+{
+    Feedback* f = (Feedback*)calloc(1, sizeof(Feedback));
+    f->prog = feedback_program(NULL, "pos", "delta");
+    if (cfg->adaptive)
+    {
+        f->adapt = feedback_program(adapt_geom_src, "stipple", "moved");
+        f->frame_loc = glGetUniformLocation(f->adapt, "frame");
+        glUniform1f(glGetUniformLocation(f->adapt, "hysteresis"),
+                    ADAPTIVE_HYSTERESIS);
+        glGenBuffers(1, &f->blank);
+        glGenBuffers(1, &f->blank_delta);
+    }
+
+    glGenBuffers(1, &f->indices);
+    glGenBuffers(1, &f->prev);
+    glGenBuffers(1, &f->delta);
+
+    glGenVertexArrays(1, &f->vao);
+    glBindVertexArray(f->vao);
+        glBindBuffer(GL_ARRAY_BUFFER, f->indices);
+        glEnableVertexAttribArray(0);
+        glVertexAttribIPointer(0, 1, GL_UNSIGNED_INT, 0, 0);
+        glBindBuffer(GL_ARRAY_BUFFER, f->prev);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    glBindVertexArray(0);
+
+    glGenVertexArrays(1, &f->stats_vao);
+    glBindVertexArray(f->stats_vao);
+        glBindBuffer(GL_ARRAY_BUFFER, f->delta);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 1, GL_FLOAT, GL_FALSE, 0, 0);
+        glBindBuffer(GL_ARRAY_BUFFER, v->pts);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    glBindVertexArray(0);
+
+    f->stats_prog = program_new(stats_vert_src, stats_frag_src);
+    f->stats_target_loc = glGetUniformLocation(f->stats_prog, "target");
+    f->stats_channel_loc = glGetUniformLocation(f->stats_prog, "channel");
+
+    f->stats_tex = texture_new();
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, STATS_WIDTH, 1,
+                 0, GL_RED, GL_FLOAT, 0);
+    glGenFramebuffers(1, &f->stats_fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, f->stats_fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, f->stats_tex, 0);
+    fbo_check("stats");
+
+    state_reset();
+    return f;
+}
+
+/*
+ *  Sets the uniforms that stay fixed for this image and (re)allocates the
+ *  per-point buffers if the sample count changed
+ */
+void feedback_resize(const Config* cfg, const Sum* s, Feedback* f)
+{
+    for (unsigned i=0; i < 2; ++i)
+    {
+        const GLuint prog = i ? f->adapt : f->prog;
+        if (!prog)
+        {
+            continue;
+        }
+        glUseProgram(prog);
+        glUniform2f(glGetUniformLocation(prog, "size"),
+                    cfg->width, cfg->height);
+        glUniform1i(glGetUniformLocation(prog, "cols"), s->cols);
+    }
+    if (f->adapt)
+    {
+        const float r = config_dot_radius(cfg);
+        glUseProgram(f->adapt);
+        glUniform1f(glGetUniformLocation(f->adapt, "target"), M_PI * r * r);
+    }
+    state_reset();
+
+    if (cfg->samples == f->samples)
+    {
+        return;
+    }
+    f->samples = cfg->samples;
+
+    glBindBuffer(GL_ARRAY_BUFFER, f->indices);
+    feedback_indices(f->samples);
+    glBindBuffer(GL_ARRAY_BUFFER, f->prev);
+    glBufferData(GL_ARRAY_BUFFER, f->samples * 3 * sizeof(float),
+                 NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_ARRAY_BUFFER, f->delta);
+    glBufferData(GL_ARRAY_BUFFER, f->samples * sizeof(float),
+                 NULL, GL_DYNAMIC_COPY);
+
+    if (f->adapt)
+    {
+        float* buf = (float*)malloc(f->samples * 3 * sizeof(float));
+        for (uint32_t i=0; i < f->samples * 3; ++i)
+        {
+            buf[i] = (i % 3 == 2) ? -1.0f : 0.0f;
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, f->blank);
+        glBufferData(GL_ARRAY_BUFFER, f->samples * 3 * sizeof(float),
+                     buf, GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, f->blank_delta);
+        for (uint32_t i=0; i < f->samples; ++i)
+        {
+            buf[i] = -1.0f;
+        }
+        glBufferData(GL_ARRAY_BUFFER, f->samples * sizeof(float),
+                     buf, GL_STATIC_DRAW);
+        free(buf);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void feedback_draw(Config* cfg, Voronoi* v, Sum* s, Feedback* f)
+{
+    /*  Nothing is rasterized, but drawing still needs a complete
+     *  framebuffer, and headless contexts have no default one  */
+    state_framebuffer(s->fbo, s->cols, s->blocks * s->rows);
+
+    /*  Keep the old positions around to measure how far points move  */
+    glBindBuffer(GL_COPY_READ_BUFFER, v->pts);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, f->prev);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                        0, 0, cfg->samples * 3 * sizeof(float));
+
+    /*  Points that aren't written this time around are left dead  */
+    if (f->adapt)
+    {
+        glBindBuffer(GL_COPY_READ_BUFFER, f->blank);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, v->pts);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                            0, 0, cfg->samples * 3 * sizeof(float));
+        glBindBuffer(GL_COPY_READ_BUFFER, f->blank_delta);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, f->delta);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                            0, 0, cfg->samples * sizeof(float));
+    }
+
+    glEnable(GL_RASTERIZER_DISCARD);
+    state_vao(f->vao);
+    if (f->adapt)
+    {
+        state_program(f->adapt);
+        glUniform1i(f->frame_loc, f->frame++);
+    }
+    else
+    {
+        state_program(f->prog);
+    }
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, s->out);
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, v->pts);
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 1, f->delta);
+
+    glBeginTransformFeedback(GL_POINTS);
+    glDrawArrays(GL_POINTS, 0, cfg->samples);
+    glEndTransformFeedback();
+
+    glDisable(GL_RASTERIZER_DISCARD);
+}
+
+/*
+ *  Reduces the displacements from the last feedback_draw on the GPU,
+ *  leaving the maximum and total distance moved (in pixels), the number
+ *  of live points and (if 'weights' is set) their total weight in the
+ *  pixels of f->stats_fbo.  Outside --adaptive mode, every point is live
+ *  and the count is left at 0.  Nothing is read back here.
+ */
+void feedback_displacement(Config* cfg, Feedback* f, bool weights)
+{
+    state_framebuffer(f->stats_fbo, STATS_WIDTH, 1);
+
+    const GLfloat zero[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    glClearBufferfv(GL_COLOR, 0, zero);
+
+    state_program(f->stats_prog);
+    state_vao(f->stats_vao);
+
+    for (int channel=0; channel < STATS_WIDTH; ++channel)
+    {
+        if ((channel == 2 && !f->adapt) || (channel == 3 && !weights))
+        {
+            continue;
+        }
+        state_blend(channel ? GL_FUNC_ADD : GL_MAX);
+        glUniform1i(f->stats_channel_loc, channel);
+        glUniform1f(f->stats_target_loc,
+                    2.0f * (channel + 0.5f) / STATS_WIDTH - 1.0f);
+        glDrawArrays(GL_POINTS, 0, cfg->samples);
+    }
+}
+
+/******************************************************************************/
+
+/*  Stages of the update loop, as timed by Timers  */
+typedef enum {
+    STAGE_VORONOI,
+    STAGE_SUM,
+    STAGE_FEEDBACK,
+    STAGE_COUNT
+} Stage;
+
+const char* stage_names[STAGE_COUNT] = {"voronoi", "sum", "feedback"};
+
+/*
+ *  GPU timers for each stage of the update loop.  Queries are
+ *  double-buffered: results for an iteration are collected after the
+ *  next one has been submitted, so reading them doesn't drain the GPU.
+ *  A stage that runs once per window (with --tile) gets a query per
+ *  window, and its times are added up when they're collected.
+ */
+typedef struct Timers_
+{
+    GLuint* queries[2][STAGE_COUNT];
+    unsigned slots[2][STAGE_COUNT]; /*  Queries allocated               */
+    unsigned used[2][STAGE_COUNT];  /*  Queries begun in this iteration */
+    unsigned frame;         /*  Iterations submitted so far             */
+
+    double* ms[STAGE_COUNT];/*  Collected times (milliseconds)          */
+    double last[STAGE_COUNT];   /*  Most recent times, however many kept   */
+    unsigned count;         /*  Number of iterations collected          */
+    unsigned capacity;
+} Timers;
+
+Timers* timers_new(unsigned capacity)
+{
+    Timers* t = (Timers*)calloc(1, sizeof(Timers));
+    for (unsigned i=0; i < STAGE_COUNT; ++i)
+    {
+        t->ms[i] = (double*)calloc(capacity, sizeof(double));
+    }
+    t->capacity = capacity;
+    return t;
+}
+
+void timers_free(Timers* t)
+{
+    for (unsigned i=0; i < STAGE_COUNT; ++i)
+    {
+        for (unsigned b=0; b < 2; ++b)
+        {
+            glDeleteQueries(t->slots[b][i], t->queries[b][i]);
+            free(t->queries[b][i]);
+        }
+        free(t->ms[i]);
+    }
+    free(t);
+}
+
+/*
+ *  Starts timing a stage of the current iteration (no-op if t is NULL),
+ *  adding a query if the stage has already run this iteration
+ */
+void timers_begin(Timers* t, Stage stage)
+{
+    if (t)
+    {
+        const unsigned b = t->frame % 2;
+        const unsigned n = t->used[b][stage]++;
+        if (n == t->slots[b][stage])
+        {
+            const unsigned slots = n ? 2 * n : 1;
+            t->queries[b][stage] = (GLuint*)realloc(
+                    t->queries[b][stage], slots * sizeof(GLuint));
+            glGenQueries(slots - n, t->queries[b][stage] + n);
+            t->slots[b][stage] = slots;
+        }
+        glBeginQuery(GL_TIME_ELAPSED, t->queries[b][stage][n]);
+    }
+}
+
+void timers_end(Timers* t)
+{
+    if (t)
+    {
+        glEndQuery(GL_TIME_ELAPSED);
+    }
+}
+
+/*
+ *  Stores the results of queries in the given buffer
+ */
+void timers_collect(Timers* t, unsigned buffer)
+{
+    for (unsigned i=0; i < STAGE_COUNT; ++i)
+    {
+        GLuint64 ns = 0;
+        for (unsigned j=0; j < t->used[buffer][i]; ++j)
+        {
+            GLuint64 q;
+            glGetQueryObjectui64v(t->queries[buffer][i][j], GL_QUERY_RESULT,
+                                  &q);
+            ns += q;
+        }
+        t->used[buffer][i] = 0;
+        t->last[i] = ns / 1e6;
+        if (t->count < t->capacity)
+        {
+            t->ms[i][t->count] = ns / 1e6;
+        }
+    }
+    if (t->count < t->capacity)
+    {
+        t->count++;
+    }
+}
+
+/*
+ *  Marks the end of an iteration, collecting the previous iteration's
+ *  results (which are ready or nearly so by now)
+ */
+void timers_frame(Timers* t)
+{
+    if (t)
+    {
+        if (t->frame > 0)
+        {
+            timers_collect(t, (t->frame - 1) % 2);
+        }
+        t->frame++;
+    }
+}
+
+/*
+ *  Collects the last outstanding iteration
+ */
+void timers_flush(Timers* t)
+{
+    if (t->frame > 0)
+    {
+        timers_collect(t, (t->frame - 1) % 2);
+    }
+    memset(t->used, 0, sizeof(t->used));
+    t->frame = 0;
+}
+
+/*
+ *  Discards collected results (e.g. after warmup)
+ */
+void timers_reset(Timers* t)
+{
+    timers_flush(t);
+    t->count = 0;
+}
+
+/*
+ *  Returns the value at the given percentile (0 - 100) of n values,
+ *  sorting them in place
+ */
+int double_cmp(const void* a, const void* b)
+{
+    const double x = *(const double*)a;
+    const double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(double* values, unsigned n, double pct)
+{
+    qsort(values, n, sizeof(double), double_cmp);
+    unsigned i = (unsigned)ceil(pct / 100.0 * n);
+    return values[i ? i - 1 : 0];
+}
+
+/******************************************************************************/
+
+/*  Output is formatted into this much memory before each write  */
+#define WRITER_BUFFER_SIZE (1 << 20)
+
+/*  Most characters that writer_float can produce  */
+#define WRITER_FLOAT_MAX 32
+
+/*  Largest value accepted by --precision  */
+#define WRITER_MAX_PRECISION 6
+
+/*
+ *  A buffered output file, written either plainly or through zlib
+ */
+typedef struct Writer_
+{
+    FILE* file;     /*  Plain output, or NULL  */
+    gzFile gz;      /*  Compressed output, or NULL  */
+
+    char* buf;
+    size_t used;
+    bool failed;    /*  Set by the first failed write  */
+} Writer;
+
+/*
+ *  Checks whether a string ends with the given suffix
+ */
+bool has_suffix(const char* s, const char* suffix)
+{
+    size_t len = strlen(s);
+    size_t n = strlen(suffix);
+    return len >= n && !strcmp(s + len - n, suffix);
+}
+
+/*
+ *  Opens a file for writing, compressing it if the name ends in .svgz
+ *  or .gz.
+ *  Prints an error and returns NULL on failure.
+ */
+Writer* writer_open(const char* filename)
+{
+    Writer* w = (Writer*)calloc(1, sizeof(Writer));
+    if (has_suffix(filename, ".svgz") || has_suffix(filename, ".gz"))
+    {
+        w->gz = gzopen(filename, "wb");
+    }
+    else
+    {
+        w->file = fopen(filename, "wb");
+    }
+
+    if (!w->file && !w->gz)
+    {
+        perror("File opening failed");
+        free(w);
+        return NULL;
+    }
+    w->buf = (char*)malloc(WRITER_BUFFER_SIZE);
+    return w;
+}
+
+/*
+ *  Writes out any buffered data
+ */
+void writer_flush(Writer* w)
+{
+    if (w->used && !w->failed)
+    {
+        w->failed = w->gz ? gzwrite(w->gz, w->buf, w->used) != (int)w->used
+                          : fwrite(w->buf, 1, w->used, w->file) != w->used;
+    }
+    w->used = 0;
+}
+
+/*
+ *  Makes room for at least n more bytes in the buffer
+ */
+void writer_reserve(Writer* w, size_t n)
+{
+    assert(n <= WRITER_BUFFER_SIZE);
+    if (w->used + n > WRITER_BUFFER_SIZE)
+    {
+        writer_flush(w);
+    }
+}
+
+void writer_puts(Writer* w, const char* str)
+{
+    for (size_t n = strlen(str); n; )
+    {
+        writer_reserve(w, 1);
+        size_t chunk = WRITER_BUFFER_SIZE - w->used;
+        chunk = (chunk < n) ? chunk : n;
+        memcpy(w->buf + w->used, str, chunk);
+        w->used += chunk;
+        str += chunk;
+        n -= chunk;
+    }
+}
+
+/*
+ *  Formats a float with at most 'precision' decimal places, dropping
+ *  trailing zeros.  This avoids printf's locale and format parsing,
+ *  which dominate the cost of writing large files.
+ */
+void writer_float(Writer* w, float v, int precision)
+{
+    static const uint32_t scale[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+    assert(precision >= 0 && precision <= WRITER_MAX_PRECISION);
+    writer_reserve(w, WRITER_FLOAT_MAX);
+    char* out = w->buf + w->used;
+
+    const bool negative = v < 0;
+    const double scaled = fabs((double)v) * scale[precision] + 0.5;
+    if (!isfinite(scaled) || scaled >= 1e18)
+    {
+        w->used += sprintf(out, "%g", v);
+        return;
+    }
+
+    uint64_t i = (uint64_t)scaled;
+    uint64_t whole = i / scale[precision];
+    uint32_t frac = i % scale[precision];
+    if (negative && i)
+    {
+        *out++ = '-';
+    }
+
+    char digits[20];
+    int n = 0;
+    do
+    {
+        digits[n++] = '0' + whole % 10;
+        whole /= 10;
+    } while (whole);
+    while (n)
+    {
+        *out++ = digits[--n];
+    }
+
+    if (frac)
+    {
+        int places = precision;
+        for (; frac % 10 == 0; frac /= 10)
+        {
+            places--;
+        }
+        *out++ = '.';
+        for (int j=places - 1; j >= 0; --j, frac /= 10)
+        {
+            out[j] = '0' + frac % 10;
+        }
+        out += places;
+    }
+    w->used = out - w->buf;
+}
+
+/*
+ *  Flushes and closes the file, then frees the writer.
+ *  Prints an error and returns false if any write failed.
+ */
+bool writer_close(Writer* w)
+{
+    writer_flush(w);
+    bool ok = !w->failed;
+    if (w->gz)
+    {
+        ok = (gzclose(w->gz) == Z_OK) && ok;
+    }
+    else
+    {
+        ok = !fclose(w->file) && ok;
+    }
+
+    if (!ok)
+    {
+        perror("File writing failed");
+    }
+    free(w->buf);
+    free(w);
+    return ok;
+}
+
+/*
+ *  Writes stipples as SVG circles, in image pixel coordinates
+ */
+bool svg_write(const Config* c, const float (*pts)[3], const char* filename)
+{
+    Writer* w = writer_open(filename);
+    if (!w)
+    {
+        return false;
+    }
+
+    char header[256];
+    snprintf(header, sizeof(header),
+        "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\"?>\n"
+        "<svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\"\n"
+        "    viewBox=\"0 0 %u %u\" width=\"%u\" height=\"%u\" id=\"swingline\">\n"
+        "<g fill=\"black\">\n",
+        c->width, c->height, c->width, c->height);
+    writer_puts(w, header);
+
+    const float r = config_dot_radius(c);
+    for (uint32_t i=0; i < c->samples; ++i)
+    {
+        writer_puts(w, "<circle cx=\"");
+        writer_float(w, c->width*pts[i][0], c->precision);
+        writer_puts(w, "\" cy=\"");
+        writer_float(w, c->height - c->height*pts[i][1], c->precision);
+        writer_puts(w, "\" r=\"");
+        writer_float(w, r * pts[i][2], c->precision);
+        writer_puts(w, "\"/>\n");
+    }
+
+    writer_puts(w, "</g>\n</svg>\n");
+    return writer_close(w);
+}
+
+/*
+ *  Writes stipples as CSV rows of x, y, radius, in the same image pixel
+ *  coordinates as the SVG output
+ */
+bool csv_write(const Config* c, const float (*pts)[3], const char* filename)
+{
+    Writer* w = writer_open(filename);
+    if (!w)
+    {
+        return false;
+    }
+
+    writer_puts(w, "x,y,r\n");
+    const float r = config_dot_radius(c);
+    for (uint32_t i=0; i < c->samples; ++i)
+    {
+        writer_float(w, c->width*pts[i][0], c->precision);
+        writer_puts(w, ",");
+        writer_float(w, c->height - c->height*pts[i][1], c->precision);
+        writer_puts(w, ",");
+        writer_float(w, r * pts[i][2], c->precision);
+        writer_puts(w, "\n");
+    }
+    return writer_close(w);
+}
+
+/*  Identifies binary point files, followed by POINTS_VERSION  */
+#define POINTS_MAGIC "SWPT"
+#define POINTS_VERSION 1
+
+/*
+ *  Header of a binary point file.  All fields are little-endian, and the
+ *  header is followed by 'samples' points of three floats each:
+ *  x and y in the 0 to 1 range with y pointing up, then a weight from
+ *  0 to 1.  A point with weight w is drawn with radius w * radius pixels.
+ *  'iterations' counts the update steps that produced the points, so that
+ *  checkpoints can be resumed.
+ *  The header is 32 bytes so that the point array stays 16-byte aligned
+ *  when the file is mapped into memory.
+ */
+typedef struct PointsHeader_
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t samples;
+    float radius;
+    uint32_t iterations;
+    uint32_t reserved;
+} PointsHeader;
+
+/*
+ *  Writes a binary point file (see PointsHeader)
+ */
+bool points_write(const Config* c, const float (*pts)[3], const char* filename,
+                  uint32_t iterations)
+{
+    _Static_assert(sizeof(PointsHeader) == 32, "PointsHeader must be packed");
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Binary point files are written in host byte order"
+#endif
+
+    PointsHeader header = {
+        .magic = POINTS_MAGIC,
+        .version = POINTS_VERSION,
+        .width = c->width,
+        .height = c->height,
+        .samples = c->samples,
+        .radius = config_dot_radius(c),
+        .iterations = iterations};
+
+    FILE* f = fopen(filename, "wb");
+    if (!f)
+    {
+        perror("File opening failed");
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(pts, 3 * sizeof(float), c->samples, f) == c->samples;
+    ok = !fclose(f) && ok;
+    if (!ok)
+    {
+        perror("File writing failed");
+    }
+    return ok;
+}
+
+/*
+ *  Reads a binary point file, storing its header.  Prints an error and
+ *  returns NULL if the file can't be read or holds invalid points.
+ */
+float (*points_read(const char* filename, PointsHeader* header))[3]
+{
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+    {
+        perror("File opening failed");
+        return NULL;
+    }
+
+    float (*pts)[3] = NULL;
+    if (fread(header, sizeof(*header), 1, f) != 1 ||
+        memcmp(header->magic, POINTS_MAGIC, 4) ||
+        header->version != POINTS_VERSION)
+    {
+        fprintf(stderr, "Error: %s is not a point file\n", filename);
+    }
+    else if (header->samples == 0 || header->samples > VORONOI_MAX_SAMPLES)
+    {
+        fprintf(stderr, "Error: invalid number of points in %s (%u)\n",
+                filename, header->samples);
+    }
+    else
+    {
+        pts = (float (*)[3])malloc(3 * sizeof(float) * header->samples);
+        bool ok = fread(pts, 3 * sizeof(float), header->samples, f) ==
+                  header->samples;
+        for (uint32_t i=0; ok && i < header->samples; ++i)
+        {
+            ok = pts[i][0] >= 0.0f && pts[i][0] <= 1.0f &&
+                 pts[i][1] >= 0.0f && pts[i][1] <= 1.0f &&
+                 pts[i][2] >= 0.0f && pts[i][2] <= 1.0f;
+        }
+        if (!ok)
+        {
+            fprintf(stderr, "Error: %s is truncated or corrupt\n", filename);
+            free(pts);
+            pts = NULL;
+        }
+    }
+    fclose(f);
+    return pts;
+}
+
+/*
+ *  Writes a checkpoint through a temporary file, so that an interrupted
+ *  write never clobbers the previous checkpoint
+ */
+bool checkpoint_write(const Config* c, const float (*pts)[3],
+                      uint32_t iterations)
+{
+    char* tmp = (char*)malloc(strlen(c->checkpoint) + 5);
+    sprintf(tmp, "%s.tmp", c->checkpoint);
+
+    bool ok = points_write(c, pts, tmp, iterations);
+    if (ok && rename(tmp, c->checkpoint))
+    {
+        perror("Checkpoint renaming failed");
+        ok = false;
+    }
+    free(tmp);
+    return ok;
+}
+
+/*
+ *  Picks the output format for a file, from cfg->format if set and
+ *  otherwise from the extension.  Returns OUTPUT_AUTO if unknown.
+ */
+OutputFormat output_format(const Config* cfg, const char* filename)
+{
+    if (cfg->format != OUTPUT_AUTO)
+    {
+        return cfg->format;
+    }
+    else if (has_suffix(filename, ".svg") || has_suffix(filename, ".svgz"))
+    {
+        return OUTPUT_SVG;
+    }
+    else if (has_suffix(filename, ".csv") || has_suffix(filename, ".csv.gz"))
+    {
+        return OUTPUT_CSV;
+    }
+    else if (has_suffix(filename, ".bin"))
+    {
+        return OUTPUT_BIN;
+    }
+    return OUTPUT_AUTO;
+}
+
+/*
+ *  Writes points to cfg->out in the format picked by output_format
+ */
+bool points_save(const Config* c, const float (*pts)[3], uint32_t iterations)
+{
+    const double start = span_begin();
+    bool ok = false;
+    switch (output_format(c, c->out))
+    {
+        case OUTPUT_SVG:
+            ok = svg_write(c, pts, c->out);
+            break;
+        case OUTPUT_CSV:
+            ok = csv_write(c, pts, c->out);
+            break;
+        case OUTPUT_BIN:
+            ok = points_write(c, pts, c->out, iterations);
+            break;
+        case OUTPUT_AUTO:
+            assert(false);
+    }
+    span_end("export", c->out, start);
+    return ok;
+}
+
+/******************************************************************************/
+
+/*  Readbacks in flight at once.  With three, the CPU consumes the copy
+ *  from two submissions ago while the GPU works on the current one.  */
+#define READBACK_DEPTH 3
+
+/*
+ *  A ring of staging buffers for reading data back from the GPU without
+ *  draining the pipeline.  Each copy is guarded by a fence and only mapped
+ *  once the fence has signalled (or when the caller asks to wait).
+ */
+typedef struct Readback_
+{
+    GLuint buf[READBACK_DEPTH];
+    GLsync fence[READBACK_DEPTH];
+    size_t size[READBACK_DEPTH];    /*  Allocated bytes per buffer  */
+    size_t bytes[READBACK_DEPTH];   /*  Bytes in the pending copy  */
+    int tag[READBACK_DEPTH];        /*  Caller's label for each copy  */
+
+    unsigned head;      /*  Oldest pending copy  */
+    unsigned count;     /*  Number of pending copies  */
+    bool mapped;        /*  Set while the oldest copy is mapped  */
+} Readback;
+
+Readback* readback_new()
+{
+    Readback* r = (Readback*)calloc(1, sizeof(Readback));
+    glGenBuffers(READBACK_DEPTH, r->buf);
+    return r;
+}
+
+/*
+ *  Releases the oldest pending copy
+ */
+void readback_pop(Readback* r)
+{
+    assert(r->count);
+    if (r->mapped)
+    {
+        glBindBuffer(GL_COPY_READ_BUFFER, r->buf[r->head]);
+        glUnmapBuffer(GL_COPY_READ_BUFFER);
+        r->mapped = false;
+    }
+    glDeleteSync(r->fence[r->head]);
+    r->head = (r->head + 1) % READBACK_DEPTH;
+    r->count--;
+}
+
+/*
+ *  Discards every pending copy
+ */
+void readback_clear(Readback* r)
+{
+    while (r->count)
+    {
+        readback_pop(r);
+    }
+}
+
+/*
+ *  Returns the staging buffer for the next copy, sized for 'bytes'.
+ *  If every buffer is busy, the oldest pending copy is discarded.
+ *  The caller fills it (e.g. with glCopyBufferSubData or a glReadPixels
+ *  into GL_PIXEL_PACK_BUFFER) then calls readback_commit.
+ */
+GLuint readback_next(Readback* r, size_t bytes)
+{
+    if (r->count == READBACK_DEPTH)
+    {
+        readback_pop(r);
+    }
+
+    const unsigned i = (r->head + r->count) % READBACK_DEPTH;
+    if (r->size[i] < bytes)
+    {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, r->buf[i]);
+        glBufferData(GL_COPY_WRITE_BUFFER, bytes, NULL, GL_STREAM_READ);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        r->size[i] = bytes;
+    }
+    r->bytes[i] = bytes;
+    return r->buf[i];
+}
+
+/*
+ *  Fences the buffer returned by readback_next, labelling it with 'tag'
+ */
+void readback_commit(Readback* r, int tag)
+{
+    const unsigned i = (r->head + r->count) % READBACK_DEPTH;
+    r->fence[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    r->tag[i] = tag;
+    r->count++;
+
+    /*  Make sure the fence actually reaches the GPU, so that later
+     *  non-blocking polls can see it signal  */
+    glFlush();
+}
+
+/*
+ *  Copies part of a buffer object into the next staging buffer
+ */
+void readback_buffer(Readback* r, GLuint src, size_t bytes, int tag)
+{
+    glBindBuffer(GL_COPY_READ_BUFFER, src);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, readback_next(r, bytes));
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, bytes);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    readback_commit(r, tag);
+}
+
+/*
+ *  Reads single-channel float pixels from a framebuffer into the next
+ *  staging buffer
+ */
+void readback_pixels(Readback* r, GLuint fbo, GLsizei w, GLsizei h, int tag)
+{
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback_next(r, w * h * sizeof(float)));
+    glReadPixels(0, 0, w, h, GL_RED, GL_FLOAT, NULL);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    readback_commit(r, tag);
+}
+
+/*
+ *  Maps the oldest pending copy, storing its tag.  Returns NULL if there
+ *  is nothing pending or, unless 'wait' is set, if the GPU hasn't finished
+ *  the copy yet.  The mapping stays valid until readback_pop.
+ */
+const void* readback_poll(Readback* r, bool wait, int* tag)
+{
+    if (!r->count)
+    {
+        return NULL;
+    }
+
+    const unsigned i = r->head;
+    if (!r->mapped)
+    {
+        GLenum status;
+        do
+        {
+            status = glClientWaitSync(r->fence[i], GL_SYNC_FLUSH_COMMANDS_BIT,
+                                      wait ? 1000000000 : 0);
+        } while (wait && status == GL_TIMEOUT_EXPIRED);
+
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+        {
+            return NULL;
+        }
+    }
+
+    glBindBuffer(GL_COPY_READ_BUFFER, r->buf[i]);
+    const void* data = glMapBufferRange(GL_COPY_READ_BUFFER, 0, r->bytes[i],
+                                        GL_MAP_READ_BIT);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    r->mapped = true;
+
+    if (tag)
+    {
+        *tag = r->tag[i];
+    }
+    return data;
+}
+
+/******************************************************************************/
+
+/*  Iterations between convergence checks in --tolerance mode  */
+#define CONVERGENCE_INTERVAL 10
+
+/*  These are the three stages in the stipple update loop  */
+typedef struct Pipeline_
+{
+    Voronoi* v;
+    Sum* s;
+    Feedback* f;
+
+    Timers* timers; /*  Per-stage GPU timers, or NULL if not timing  */
+
+    Readback* points;   /*  Copies of v->pts  */
+    Readback* stats;    /*  Displacement from feedback_displacement  */
+
+    uint32_t iterations;    /*  Steps run since the points were loaded  */
+
+    Window* windows;        /*  Regions rendered in each step   */
+    unsigned window_count;
+    stbi_uc* tile_img;      /*  Staging for streamed windows    */
+} Pipeline;
 
 /*
- *  Creates an OpenGL context (3.3 or higher)
- *  Returns a window pointer; the context is made current
+ *  Compiles every program used by the update loop.  Nothing is sized
+ *  until pipeline_load is called.
  */
-GLFWwindow* make_context(uint16_t width, uint16_t height, bool hide)
+Pipeline* pipeline_new(Config* cfg)
 {
-    if (!glfwInit())
+    Pipeline* p = (Pipeline*)calloc(1, sizeof(Pipeline));
+    p->v = voronoi_new(cfg);
+    p->s = sum_new(cfg);
+    p->f = feedback_new(cfg, p->v);
+    p->points = readback_new();
+    p->stats = readback_new();
+    if (telemetry)
     {
-        fprintf(stderr, "Error: Failed to initialize GLFW!\n");
-        exit(-1);
+        p->timers = timers_new(0);
     }
+    return p;
+}
 
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-    glfwWindowHint(GLFW_VISIBLE, !hide);
-
-    GLFWwindow* const window = glfwCreateWindow(
-            width, height, "swingline", NULL, NULL);
-
-    if (!window)
+/*
+ *  Splits the image into windows: a single one covering the whole image,
+ *  or in --tile mode a grid of tiles with halos.  A streamed image that
+ *  fits in a single window is uploaded here once, rather than every step.
+ *  Returns false if the image couldn't be read.
+ */
+bool pipeline_windows(const Config* cfg, Pipeline* p)
+{
+    const uint32_t t = cfg->tile ? cfg->tile : (uint32_t)-1;
+    const uint32_t halo = config_halo(cfg);
+    const uint32_t nx = cfg->tile ? (cfg->width + t - 1) / t : 1;
+    const uint32_t ny = cfg->tile ? (cfg->height + t - 1) / t : 1;
+
+    p->window_count = nx * ny;
+    p->windows = (Window*)realloc(p->windows, p->window_count * sizeof(Window));
+    for (uint32_t i=0; i < p->window_count; ++i)
     {
-        fprintf(stderr, "Error:  Failed to create window");
-        exit(-1);
+        const int64_t x = (int64_t)(i % nx) * t;
+        const int64_t y = (int64_t)(i / nx) * t;
+        Window* w = &p->windows[i];
+        w->x = x - halo;
+        w->y = y - halo;
+        w->x0 = halo;
+        w->y0 = halo;
+        w->x1 = halo + ((cfg->width - x < t) ? cfg->width - x : t);
+        w->y1 = halo + ((cfg->height - y < t) ? cfg->height - y : t);
     }
 
-    glfwMakeContextCurrent(window);
-    {   /* Check that the OpenGL version is new enough */
-        const GLubyte* ver = glGetString(GL_VERSION);
-        const uint8_t major = ver[0] - '0';
-        const uint8_t minor = ver[2] - '0';
-        if (major * 10 + minor < 33)
-        {
-            fprintf(stderr, "Error: OpenGL context is too old"
-                            " (require 3.3, got %u.%u)\n", major, minor);
-            exit(-1);
+    free(p->tile_img);
+    p->tile_img = NULL;
+    if (cfg->source)
+    {
+        p->tile_img = (stbi_uc*)malloc((size_t)p->v->width * p->v->height);
+        if (p->window_count == 1)
+        {
+            const Window* w = &p->windows[0];
+            if (!tile_source_read(cfg->source, w->x, w->y, p->v->width,
+                                  p->v->height, p->tile_img))
+            {
+                return false;
+            }
+            voronoi_upload(p->v, p->tile_img);
         }
     }
-    return window;
+    return true;
 }
 
-/******************************************************************************/
-
-GLuint texture_new()
+/*
+ *  Points every stage at cfg's image, reseeding the points if 'seed' is
+ *  set.  Pending displacements and snapshots are discarded, since they
+ *  were measured on the previous image (or --pyramid level).  Returns
+ *  false if the image or sample count is too large.
+ */
+bool pipeline_resize(Config* cfg, Pipeline* p, bool seed)
 {
-    GLuint tex;
-    glGenTextures(1, &tex);
-
-    glBindTexture(GL_TEXTURE_2D, tex);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-
-    return tex;
+    readback_clear(p->points);
+    readback_clear(p->stats);
+    if (!voronoi_load(cfg, p->v, seed) || !sum_resize(cfg, p->s) ||
+        !pipeline_windows(cfg, p))
+    {
+        return false;
+    }
+    feedback_resize(cfg, p->s, p->f);
+    return true;
 }
 
-/******************************************************************************/
-
-void fbo_check(const char* description)
-{   /*  Check to see if the framebuffer is complete  */
-    int status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if (status != GL_FRAMEBUFFER_COMPLETE)
+/*
+ *  Uploads cfg->img and seeds a fresh set of points (or, if 'seed' is
+ *  unset, carries on from the current ones), reallocating textures and
+ *  buffers only if their sizes changed since the last image.  Returns
+ *  false if the image or sample count is too large for the GPU.
+ */
+bool pipeline_load(Config* cfg, Pipeline* p, bool seed)
+{
+    if (!pipeline_resize(cfg, p, seed))
     {
-        fprintf(stderr, "Error: %s framebuffer is incomplete (%i)\n",
-                description, status);
-        exit(-1);
+        return false;
     }
+    p->iterations = (seed && cfg->start) ? cfg->start_iter : 0;
+    return true;
 }
 
-////////////////////////////////////////////////////////////////////////////////
+/*  From GL_NVX_gpu_memory_info, for reporting free video memory  */
+#ifndef GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX
+#define GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX 0x9049
+#endif
 
-typedef struct Config_ {
-    stbi_uc* img;           /*  Pointer to raw image data  */
+/*  Whether this thread's context reports free memory, or -1 if unknown  */
+__thread int telemetry_vram = -1;
 
-    uint16_t width, height; /*  Image size   */
-    uint16_t samples;       /*  Number of Voronoi cells */
-    uint16_t resolution;    /*  Resolution of Voronoi cones  */
+/*
+ *  Returns the approximate GPU memory held by the pipeline: image-sized
+ *  targets, per-point buffers and the Sum chain
+ */
+uint64_t pipeline_bytes(const Config* cfg, const Pipeline* p)
+{
+    const Voronoi* v = p->v;
+    const uint64_t pixels = (uint64_t)v->width * v->height;
 
-    float sx, sy;           /*  Scale (used to adjust for aspect ratio) */
-    float radius;           /*  Stipple radius (in arbitrary units)     */
+    /*  Cell indices, depth, the image and its two upload buffers  */
+    uint64_t bytes = pixels * (4 + 4 + 1 + 2);
+    if (cfg->voronoi == VORONOI_JFA)
+    {
+        bytes += 2 * pixels * 4 * sizeof(float);
+    }
 
-    int iter;               /*  Number of iterations; -1 if interactive */
-    const char* out;        /*  Output file name  */
-} Config;
+    /*  Points, previous points, displacements and indices  */
+    bytes += (uint64_t)v->samples * (2 * 3 * sizeof(float) + 2 * 4);
+    return bytes + sum_bytes(p->s);
+}
 
-void config_set_aspect_ratio(Config* c)
+/*
+ *  Records one iteration's GPU stage times (once they've been collected)
+ */
+void telemetry_iteration(const Pipeline* p)
 {
-    if (c->width > c->height)
+    const Timers* t = p->timers;
+    telemetry_lock();
+    if (telemetry->metrics)
     {
-        c->sx = 1;
-        c->sy = (float)c->width / (float)c->height;
+        fprintf(telemetry->metrics, "{\"type\": \"iteration\", "
+                "\"thread\": %u, \"iteration\": %u", telemetry_tid,
+                p->iterations);
+        for (unsigned i=0; i < STAGE_COUNT; ++i)
+        {
+            fprintf(telemetry->metrics, ", \"%s_ms\": %.4f",
+                    stage_names[i], t->last[i]);
+        }
+        fprintf(telemetry->metrics, "}\n");
     }
-    else
+    if (telemetry->trace)
     {
-        c->sx = (float)c->height / (float)c->width;
-        c->sy = 1;
+        telemetry_trace_event("gpu_ms", 'C', wall_time());
+        for (unsigned i=0; i < STAGE_COUNT; ++i)
+        {
+            fprintf(telemetry->trace, "%s\"%s\": %.4f",
+                    i ? ", " : ", \"args\": {", stage_names[i], t->last[i]);
+        }
+        fprintf(telemetry->trace, "}}");
     }
+    telemetry_unlock();
 }
 
-////////////////////////////////////////////////////////////////////////////////
-
-typedef struct Voronoi_ {
-    GLuint vao;     /*  VAO with bound cone and offsets */
-    GLuint pts;     /*  VBO containing point locations  */
-    GLuint prog;    /*  Shader program (compiled)       */
-    GLuint img;     /*  Target image texture            */
+/*
+ *  Records how far points moved by the given iteration, their mean weight
+ *  (if not negative) and, for GPU runs, the pipeline's memory
+ */
+void telemetry_stats(const char* label, int iteration, float max,
+                     float mean, float weight, const Config* cfg,
+                     const Pipeline* p)
+{
+    GLint free_kb = 0;
+    if (p && telemetry_vram < 0)
+    {
+        telemetry_vram =
+            epoxy_has_gl_extension("GL_NVX_gpu_memory_info") ? 1 : 0;
+    }
+    if (p && telemetry_vram)
+    {
+        glGetIntegerv(GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX,
+                      &free_kb);
+    }
 
-    GLuint tex;     /*  RGB texture (bound to fbo)          */
-    GLuint depth;   /*  Depth texture (bound to fbo)        */
-    GLuint fbo;     /*  Framebuffer for render-to-texture   */
-} Voronoi;
+    telemetry_lock();
+    if (telemetry->metrics)
+    {
+        FILE* f = telemetry->metrics;
+        fprintf(f, "{\"type\": \"stats\", \"thread\": %u, \"label\": ",
+                telemetry_tid);
+        json_string(f, label);
+        fprintf(f, ", \"iteration\": %i, \"max_moved_px\": %g, "
+                "\"mean_moved_px\": %g", iteration, max, mean);
+        if (weight >= 0)
+        {
+            fprintf(f, ", \"mean_weight\": %g", weight);
+        }
+        if (p)
+        {
+            fprintf(f, ", \"gpu_mb\": %.3f", pipeline_bytes(cfg, p) / 1e6);
+        }
+        if (p && telemetry_vram)
+        {
+            fprintf(f, ", \"vram_free_mb\": %.1f", free_kb / 1e3);
+        }
+        fprintf(f, "}\n");
+    }
+    if (telemetry->trace)
+    {
+        telemetry_trace_event("moved_px", 'C', wall_time());
+        fprintf(telemetry->trace, ", \"args\": {\"max\": %g, \"mean\": %g}}",
+                max, mean);
+    }
+    telemetry_unlock();
+}
 
 /*
- *  Builds a vertex buffer to draw a single cone
- *  Must be called with a bound VAO; binds the cone into vertex attribute
- *  slot 0
+ *  Runs a single iteration of the update loop.  Returns false if a
+ *  streamed tile couldn't be read, leaving the iteration unfinished.
  */
-void voronoi_cone_bind(uint16_t n)
+bool pipeline_step(Config* cfg, Pipeline* p)
 {
-    GLuint vbo;
-    size_t bytes = (n + 2) * 3 * sizeof(float);
-    float* buf = (float*)malloc(bytes);
+    for (unsigned i=0; i < p->window_count; ++i)
+    {
+        /*  Streamed tiles are read back in from disk every step  */
+        const Window* w = &p->windows[i];
+        if (p->window_count > 1)
+        {
+            if (!tile_source_read(cfg->source, w->x, w->y, p->v->width,
+                                  p->v->height, p->tile_img))
+            {
+                return false;
+            }
+            voronoi_upload(p->v, p->tile_img);
+        }
+
+        /*  Render the current voronoi diagram's state to v->tex */
+        timers_begin(p->timers, STAGE_VORONOI);
+        voronoi_draw(cfg, p->v, w);
+        timers_end(p->timers);
+
+        /*  Accumulate the centroids, to be written to v->pts  */
+        timers_begin(p->timers, STAGE_SUM);
+        sum_draw(p->v, p->s, w, i == 0, i + 1 == p->window_count);
+        timers_end(p->timers);
+    }
 
-    /* This is the tip of the cone */
-    buf[0] = 0;
-    buf[1] = 0;
-    buf[2] = -1;
+    timers_begin(p->timers, STAGE_FEEDBACK);
+    feedback_draw(cfg, p->v, p->s, p->f);
+    timers_end(p->timers);
 
-    for (uint16_t i=0; i <= n; ++i)
+    timers_frame(p->timers);
+    if (telemetry && p->timers && p->timers->frame > 1)
     {
-        float angle = 2 * M_PI * i / n;
-        buf[i*3 + 3] = cos(angle);
-        buf[i*3 + 4] = sin(angle);
-        buf[i*3 + 5] = 1;
+        telemetry_iteration(p);
     }
+    p->iterations++;
+    return true;
+}
 
-    glGenBuffers(1, &vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER, bytes, buf, GL_STATIC_DRAW);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+/*
+ *  Checks for convergence in --tolerance mode, and records telemetry.
+ *  The displacement is measured every CONVERGENCE_INTERVAL iterations and
+ *  picked up a few iterations later, once the GPU has produced it.
+ */
+bool pipeline_converged(const char* label, Config* cfg, Pipeline* p)
+{
+    if (p->iterations % CONVERGENCE_INTERVAL == 0)
+    {
+        feedback_displacement(cfg, p->f, telemetry != NULL);
+        readback_pixels(p->stats, p->f->stats_fbo, STATS_WIDTH, 1,
+                        p->iterations);
+    }
 
-    free(buf);
+    int at;
+    const float* d = (const float*)readback_poll(p->stats, false, &at);
+    if (!d)
+    {
+        return false;
+    }
+
+    const float max = d[0];
+    const float live = cfg->adaptive ? d[2] : cfg->samples;
+    const float mean = d[1] / live;
+    if (telemetry)
+    {
+        telemetry_stats(label, at, max, mean, d[3] / live, cfg, p);
+    }
+    readback_pop(p->stats);
+    if (cfg->tolerance && max < cfg->tolerance)
+    {
+        fprintf(progress_file(), "\n%s: converged after %u iterations "
+                "(max displacement %g px, mean %g px at iteration %i)",
+                label, p->iterations, max, mean, at);
+        return true;
+    }
+    return false;
 }
 
 /*
- *  Builds and returns the VBO for cone instances, binding it to vertex
- *  attribute slot 1
+ *  Snapshots the points every cfg->every iterations, writing out
+ *  snapshots as they arrive from the GPU.  If 'flush' is set, waits for
+ *  and writes every pending snapshot instead.
  */
-GLuint voronoi_instances(const Config* c)
+void pipeline_checkpoint(Config* cfg, Pipeline* p, bool flush)
 {
-    GLuint vbo;
-    size_t bytes = c->samples * 3 * sizeof(float);
-    float* buf = (float*)malloc(bytes);
+    if (!flush && p->iterations % cfg->every == 0)
+    {
+        readback_buffer(p->points, p->v->pts, 3 * sizeof(float) * cfg->samples,
+                        p->iterations);
+    }
 
-    /*  Fill the buffer with values between 0 and 1, using        *
-     *  rejection sampling to create a good initial distribution  */
-    uint16_t i=0;
-    while (i < c->samples)
+    int at;
+    const float (*pts)[3];
+    while ((pts = (const float (*)[3])readback_poll(p->points, flush, &at)))
     {
-        int x = rand() % c->width;
-        int y = rand() % c->height;
-        uint8_t p = c->img[y*c->width + x];
+        checkpoint_write(cfg, pts, at);
+        readback_pop(p->points);
+    }
+}
 
-        if ((rand() % 256) > p)
+/*
+ *  Runs the update loop until cfg->iter iterations have been run (counting
+ *  any from a resumed checkpoint) or, in --tolerance mode, until
+ *  convergence, printing progress with the given label.  Returns false if
+ *  an iteration failed.
+ */
+bool pipeline_relax(const char* label, Config* cfg, Pipeline* p)
+{
+    bool ok = true;
+    while ((int64_t)p->iterations < cfg->iter)
+    {
+        fprintf(progress_file(), "\r%s: %u / %i", label, p->iterations + 1,
+                cfg->iter);
+        fflush(progress_file());
+        if (!(ok = pipeline_step(cfg, p)))
         {
-            buf[3*i]     = (x + 0.5f) / c->width;
-            buf[3*i + 1] = (y + 0.5f) / c->height;
-            buf[3*i + 2] = 0.0f;
-            i++;
+            break;
         }
-    }
 
-    glGenBuffers(1, &vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER, bytes, buf, GL_DYNAMIC_DRAW);
-
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 3*sizeof(float), 0);
-    glVertexAttribDivisor(1, 1);
+        if (cfg->checkpoint)
+        {
+            pipeline_checkpoint(cfg, p, false);
+        }
+        if ((cfg->tolerance || telemetry) &&
+            pipeline_converged(label, cfg, p))
+        {
+            break;
+        }
+    }
 
-    free(buf);
-    return vbo;
+    if (cfg->checkpoint)
+    {
+        pipeline_checkpoint(cfg, p, true);
+    }
+    if (telemetry && p->timers && p->timers->frame > 0)
+    {
+        timers_flush(p->timers);
+        telemetry_iteration(p);
+    }
+    fprintf(progress_file(), "\n");
+    return ok;
 }
 
-Voronoi* voronoi_new(const Config* cfg, uint8_t* img)
-{
-    Voronoi* v = (Voronoi*)calloc(1, sizeof(Voronoi));
-    glGenVertexArrays(1, &v->vao);
+/*  Most levels accepted by --pyramid  */
+#define PYRAMID_MAX_LEVELS 8
 
-    glBindVertexArray(v->vao);
-        voronoi_cone_bind(cfg->resolution);         /* Uses bound VAO   */
-        v->pts = voronoi_instances(cfg);            /* (same) */
-    glBindVertexArray(0);
+/*  Coarse levels stop once they'd have fewer pixels per sample than this  */
+#define PYRAMID_MIN_PIXELS_PER_SAMPLE 16
 
-    v->prog = program_link(
-        shader_compile(GL_VERTEX_SHADER, voronoi_vert_src),
-        shader_compile(GL_FRAGMENT_SHADER, voronoi_frag_src));
+/*
+ *  Returns a half-size copy of an 8-bit image, averaging 2x2 blocks (and
+ *  repeating the last row or column of odd-sized images)
+ */
+stbi_uc* image_halve(const stbi_uc* img, uint32_t width, uint32_t height)
+{
+    const uint32_t w = (width + 1) / 2;
+    const uint32_t h = (height + 1) / 2;
+    stbi_uc* out = (stbi_uc*)malloc((size_t)w * h);
+    for (uint32_t y=0; y < h; ++y)
+    {
+        const stbi_uc* r0 = img + (size_t)(2*y) * width;
+        const stbi_uc* r1 = img + (size_t)(2*y + 1 < height ? 2*y + 1 : 2*y)
+                                * width;
+        for (uint32_t x=0; x < w; ++x)
+        {
+            const uint32_t x1 = (2*x + 1 < width) ? 2*x + 1 : 2*x;
+            out[(size_t)y*w + x] =
+                (r0[2*x] + r0[x1] + r1[2*x] + r1[x1] + 2) / 4;
+        }
+    }
+    return out;
+}
 
-    v->tex   = texture_new();
-    v->depth = texture_new();
-    v->img   = texture_new();
+/*
+ *  Runs the non-interactive loop, printing progress with the given label.
+ *  Returns false if a level couldn't be set up or an iteration failed.
+ *
+ *  With --pyramid, the first iterations run on downsampled copies of the
+ *  image (with proportionally smaller Voronoi and Sum targets), refining
+ *  level by level to full resolution.  Each level gets an even share of
+ *  -i; in --tolerance mode a level moves on early once it converges
+ *  (measured in that level's pixels) and the full-resolution level may
+ *  use every remaining iteration.
+ */
+bool pipeline_run(const char* label, Config* cfg, Pipeline* p)
+{
+    Config levels[PYRAMID_MAX_LEVELS];
+    unsigned count = 1;
+    levels[0] = *cfg;
+    while (count < cfg->pyramid && (uint64_t)(levels[count - 1].width / 2) *
+           (levels[count - 1].height / 2) >=
+           (uint64_t)cfg->samples * PYRAMID_MIN_PIXELS_PER_SAMPLE)
+    {
+        const Config* prev = &levels[count - 1];
+        Config* c = &levels[count++];
+        *c = *prev;
+        c->img = image_halve(prev->img, prev->width, prev->height);
+        c->width = (prev->width + 1) / 2;
+        c->height = (prev->height + 1) / 2;
+        config_set_aspect_ratio(c);
+    }
 
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glBindTexture(GL_TEXTURE_2D, v->tex);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, cfg->width, cfg->height,
-                 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
-    glBindTexture(GL_TEXTURE_2D, v->depth);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, cfg->width, cfg->height,
-                 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
-    glBindTexture(GL_TEXTURE_2D, v->img);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, cfg->width, cfg->height,
-                 0, GL_RED, GL_UNSIGNED_BYTE, img);
+    bool ok = true;
+    const uint32_t share = (cfg->iter - p->iterations) / count;
+    for (unsigned i=count - 1; ok && i > 0; --i)
+    {
+        Config* c = &levels[i];
+        c->iter = p->iterations + share;
 
-    glGenFramebuffers(1, &v->fbo);
-    glBindFramebuffer(GL_FRAMEBUFFER, v->fbo);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                           GL_TEXTURE_2D, v->tex, 0);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
-                           GL_TEXTURE_2D, v->depth, 0);
-    fbo_check("voronoi");
+        char name[256];
+        snprintf(name, sizeof(name), "%s [%ux%u]", label, c->width, c->height);
+        if (!pipeline_resize(c, p, false))
+        {
+            break;
+        }
+        ok = pipeline_relax(name, c, p);
+    }
 
-    teardown(NULL);
-    return v;
+    /*  Finish at full resolution, freeing the coarse images  */
+    if (ok && count > 1)
+    {
+        ok = pipeline_resize(cfg, p, false);
+    }
+    for (unsigned i=1; i < count; ++i)
+    {
+        free(levels[i].img);
+    }
+    return ok && pipeline_relax(label, cfg, p);
 }
 
-void voronoi_draw(Config* cfg, Voronoi* v)
+/*
+ *  Reads back the current points and writes them to cfg->out in the
+ *  chosen output format.
+ *  Returns false if the file couldn't be written.
+ */
+bool pipeline_save(const Config* c, Pipeline* p)
 {
-    glBindFramebuffer(GL_FRAMEBUFFER, v->fbo);
+    readback_clear(p->points);
+    readback_buffer(p->points, p->v->pts, 3 * sizeof(float) * c->samples, 0);
+    const float (*pts)[3] = (const float (*)[3])readback_poll(
+            p->points, true, NULL);
+
+    /*  In --adaptive mode the live points are packed at the front  */
+    Config live = *c;
+    if (c->adaptive)
+    {
+        live.samples = 0;
+        while (live.samples < c->samples && pts[live.samples][2] >= 0.0f)
+        {
+            live.samples++;
+        }
+        fprintf(progress_file(), "%s: kept %u points\n",
+                c->image, live.samples);
+    }
 
-    GLint viewport[4];
-    glGetIntegerv(GL_VIEWPORT, viewport);
-    glViewport(0, 0, cfg->width, cfg->height);
+    bool ok = points_save(&live, pts, p->iterations);
+    readback_pop(p->points);
+    return ok;
+}
 
-    glEnable(GL_DEPTH_TEST);
-    glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
+/******************************************************************************/
 
-    glUseProgram(v->prog);
-    glBindVertexArray(v->vao);
-    glUniform2f(glGetUniformLocation(v->prog, "scale"), cfg->sx, cfg->sy);
-    glDrawArraysInstanced(GL_TRIANGLE_FAN, 0, cfg->resolution+2, cfg->samples);
+/*  Average number of sites per grid cell in the CPU engine  */
+#define CPU_SITES_PER_CELL 2
 
-    teardown(viewport);
-}
+/*
+ *  Adjacent pixels searched together by the CPU engine, one per SIMD lane.
+ *  GCC's vector extensions lower these to SSE or NEON where available
+ *  (and to scalar code elsewhere).
+ */
+#define CPU_LANES 4
+typedef float CpuFloats __attribute__((vector_size(4 * CPU_LANES)));
+typedef int32_t CpuInts __attribute__((vector_size(4 * CPU_LANES)));
 
-////////////////////////////////////////////////////////////////////////////////
+struct Cpu_;
 
-typedef struct Sum_
+/*
+ *  One thread of the CPU engine, which handles a band of image rows and
+ *  accumulates into its own per-cell sums
+ */
+typedef struct CpuWorker_
 {
-    GLuint prog;
-    GLuint fbo;
-    GLuint tex;
-    GLuint vao;
-} Sum;
+    struct Cpu_* cpu;
+    pthread_t thread;
+    uint32_t y0, y1;    /*  Rows in this band  */
+    double (*acc)[4];   /*  Per cell: weighted x, weighted y, count, weight  */
+} CpuWorker;
 
-Sum* sum_new(Config* config)
+/*
+ *  Runs the same Voronoi / centroid / update loop as the GPU pipeline, on
+ *  the CPU.  Nearest sites are found through a uniform grid of buckets,
+ *  searched outwards in rings from each pixel's bucket.
+ */
+typedef struct Cpu_
 {
-    Sum* sum = (Sum*)calloc(1, sizeof(Sum));
-    sum->vao = quad_new();
-    sum->tex = texture_new();
-    glBindTexture(GL_TEXTURE_2D, sum->tex);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, config->samples, config->height,
-                     0, GL_RGB, GL_FLOAT, 0);
-
-    glGenFramebuffers(1, &sum->fbo);
-    glBindFramebuffer(GL_FRAMEBUFFER, sum->fbo);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                           GL_TEXTURE_2D, sum->tex, 0);
-    fbo_check("sum");
+    float (*pts)[3];    /*  Points, in the same layout as v->pts  */
+    uint32_t samples;
+    float* weight;      /*  Per-pixel weight, as in sum_frag_src  */
+    uint32_t width, height;
+
+    /*  Sites sorted into grid buckets, row by row, so that a run of
+     *  buckets along a row is a run of sites  */
+    float cell;         /*  Bucket size, in pixels  */
+    uint32_t gw, gh;
+    uint32_t* start;    /*  First site in each bucket (gw * gh + 1)  */
+    float* xs;
+    float* ys;
+    uint32_t* ids;      /*  Index in pts of each sorted site  */
+
+    unsigned threads;
+    CpuWorker* workers;
+    pthread_barrier_t go;
+    pthread_barrier_t done;
+    bool quit;
+
+    uint32_t iterations;
+    float max_delta;    /*  Displacement from the last step, in pixels  */
+    float mean_delta;
+} Cpu;
 
-    sum->prog = program_link(
-        shader_compile(GL_VERTEX_SHADER, quad_vert_src),
-        shader_compile(GL_FRAGMENT_SHADER, sum_frag_src));
-
-    teardown(NULL);
-    return sum;
+/*
+ *  Checks sites k to end against a row of CPU_LANES pixels at (px, py),
+ *  keeping each pixel's nearest site (the first, if several tie)
+ */
+void cpu_sites(const Cpu* c, uint32_t k, uint32_t end, CpuFloats px,
+               float py, CpuFloats* best, CpuInts* best_i)
+{
+    for (; k < end; ++k)
+    {
+        const CpuFloats dx = c->xs[k] - px;
+        const float dy = c->ys[k] - py;
+        const CpuFloats d = dx*dx + dy*dy;
+        const CpuInts closer = d < *best;
+        *best = (CpuFloats)(((CpuInts)d & closer) |
+                            ((CpuInts)*best & ~closer));
+        *best_i = ((int32_t)k & closer) | (*best_i & ~closer);
+    }
 }
 
-void sum_draw(Config* cfg, Voronoi* v, Sum* s)
+/*
+ *  Assigns every pixel in a worker's band to its nearest site, adding its
+ *  weighted position into the worker's accumulators.  Pixels are taken
+ *  CPU_LANES at a time, searching rings of buckets around the span of
+ *  buckets they fall in.
+ */
+void cpu_band(CpuWorker* w)
 {
-    glBindFramebuffer(GL_FRAMEBUFFER, s->fbo);
-
-    // Save viewport size and restore it later
-    GLint viewport[4];
-    glGetIntegerv(GL_VIEWPORT, viewport);
-    glViewport(0, 0, cfg->samples, cfg->height);
+    const Cpu* c = w->cpu;
+    memset(w->acc, 0, c->samples * sizeof(*w->acc));
 
-    glClear(GL_COLOR_BUFFER_BIT);
-
-    glUseProgram(s->prog);
-    glBindVertexArray(s->vao);
+    CpuFloats lane;
+    for (unsigned j=0; j < CPU_LANES; ++j)
+    {
+        lane[j] = j;
+    }
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, v->tex);
-    glUniform1i(glGetUniformLocation(s->prog, "voronoi"), 0);
+    const int32_t gw = c->gw;
+    const int32_t gh = c->gh;
+    const int32_t rmax = (gw > gh) ? gw : gh;
+    for (uint32_t y=w->y0; y < w->y1; ++y)
+    {
+        const float py = y + 0.5f;
+        int32_t gy = py / c->cell;
+        gy = (gy < gh) ? gy : gh - 1;
 
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, v->img);
-    glUniform1i(glGetUniformLocation(s->prog, "img"), 1);
+        for (uint32_t x=0; x < c->width; x += CPU_LANES)
+        {
+            /*  Lanes past the end of the row are searched but not counted  */
+            const uint32_t n = (c->width - x < CPU_LANES) ? c->width - x
+                                                          : CPU_LANES;
+            const CpuFloats px = (x + 0.5f) + lane;
+            int32_t gx0 = (x + 0.5f) / c->cell;
+            int32_t gx1 = (x + n - 0.5f) / c->cell;
+            gx0 = (gx0 < gw) ? gx0 : gw - 1;
+            gx1 = (gx1 < gw) ? gx1 : gw - 1;
+
+            /*  After searching rings 0 to r, any other site is at least
+             *  r buckets away from every pixel, so stop once each pixel's
+             *  best is closer than that  */
+            CpuFloats best = (CpuFloats){0} + INFINITY;
+            CpuInts best_i = {0};
+            for (int32_t r=0; r <= rmax; ++r)
+            {
+                for (int32_t dy=-r; dy <= r; ++dy)
+                {
+                    const int32_t by = gy + dy;
+                    if (by < 0 || by >= gh)
+                    {
+                        continue;
+                    }
+
+                    /*  The top and bottom rows of a ring are each one run
+                     *  of sites; other rows only touch the ring's ends  */
+                    const uint32_t* row = c->start + by*gw;
+                    if (dy == -r || dy == r)
+                    {
+                        const int32_t bx0 = (gx0 - r > 0) ? gx0 - r : 0;
+                        const int32_t bx1 = (gx1 + r < gw) ? gx1 + r : gw - 1;
+                        cpu_sites(c, row[bx0], row[bx1 + 1], px, py,
+                                  &best, &best_i);
+                        continue;
+                    }
+                    if (gx0 - r >= 0)
+                    {
+                        cpu_sites(c, row[gx0 - r], row[gx0 - r + 1], px, py,
+                                  &best, &best_i);
+                    }
+                    if (gx1 + r < gw)
+                    {
+                        cpu_sites(c, row[gx1 + r], row[gx1 + r + 1], px, py,
+                                  &best, &best_i);
+                    }
+                }
+
+                const float reach = r * c->cell;
+                bool found = true;
+                for (unsigned j=0; j < n; ++j)
+                {
+                    found = found && best[j] <= reach * reach;
+                }
+                if (found)
+                {
+                    break;
+                }
+            }
 
-    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
-    teardown(viewport);
+            for (unsigned j=0; j < n; ++j)
+            {
+                const float weight = c->weight[(size_t)y*c->width + x + j];
+                double* a = w->acc[c->ids[best_i[j]]];
+                a[0] += px[j] * weight;
+                a[1] += py * weight;
+                a[2] += 1.0;
+                a[3] += weight;
+            }
+        }
+    }
 }
 
-////////////////////////////////////////////////////////////////////////////////
-
-typedef struct Feedback_
+void* cpu_worker(void* data)
 {
-    GLuint vao;
-    GLuint prog;
-} Feedback;
+    CpuWorker* w = (CpuWorker*)data;
+    Cpu* c = w->cpu;
+    while (true)
+    {
+        pthread_barrier_wait(&c->go);
+        if (c->quit)
+        {
+            break;
+        }
+        cpu_band(w);
+        pthread_barrier_wait(&c->done);
+    }
+    return NULL;
+}
 
-GLuint feedback_indices(uint16_t samples)
+/*
+ *  Starts the thread pool.  The calling thread acts as worker 0.
+ */
+Cpu* cpu_new(unsigned threads)
 {
-    GLuint vao;
-    GLuint vbo;
-    size_t bytes = sizeof(GLuint) * samples;
-    GLuint* indices = (GLuint*)malloc(bytes);
-
-    for (uint16_t i=0; i < samples; ++i)
+    Cpu* c = (Cpu*)calloc(1, sizeof(Cpu));
+    c->threads = threads;
+    c->workers = (CpuWorker*)calloc(threads, sizeof(CpuWorker));
+    pthread_barrier_init(&c->go, NULL, threads);
+    pthread_barrier_init(&c->done, NULL, threads);
+    for (unsigned i=0; i < threads; ++i)
     {
-        indices[i] = i;
+        c->workers[i].cpu = c;
+        if (i)
+        {
+            pthread_create(&c->workers[i].thread, NULL, cpu_worker,
+                           &c->workers[i]);
+        }
     }
+    return c;
+}
 
-    glGenVertexArrays(1, &vao);
-    glGenBuffers(1, &vbo);
+/*
+ *  Prepares for a new image, seeding points (or loading cfg->start)
+ *  if 'seed' is set, and otherwise keeping the current ones
+ */
+void cpu_load(const Config* cfg, Cpu* c, bool seed)
+{
+    c->width = cfg->width;
+    c->height = cfg->height;
+    const size_t pixels = (size_t)c->width * c->height;
+    c->weight = (float*)realloc(c->weight, pixels * sizeof(float));
+    float table[256];
+    for (unsigned i=0; i < 256; ++i)
+    {
+        table[i] = config_weight(cfg, i);
+    }
+    for (size_t i=0; i < pixels; ++i)
+    {
+        c->weight[i] = table[cfg->img[i]];
+    }
 
-    glBindVertexArray(vao);
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        glBufferData(GL_ARRAY_BUFFER, bytes, indices, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(0);
-        glVertexAttribIPointer(0, 1, GL_UNSIGNED_INT, 0, 0);
-    glBindVertexArray(0);
+    if (!seed)
+    {
+        assert(cfg->samples == c->samples);
+    }
+    else
+    {
+        c->samples = cfg->samples;
+        c->pts = (float (*)[3])realloc(c->pts, c->samples * sizeof(*c->pts));
+        if (cfg->start)
+        {
+            memcpy(c->pts, cfg->start, c->samples * sizeof(*c->pts));
+        }
+        else
+        {
+            voronoi_seed(cfg, (float*)c->pts);
+        }
+    }
 
-    free(indices);
+    c->cell = sqrt((double)pixels * CPU_SITES_PER_CELL / c->samples);
+    c->gw = ceil(c->width / c->cell);
+    c->gh = ceil(c->height / c->cell);
+    c->start = (uint32_t*)realloc(c->start, (c->gw * c->gh + 1) *
+                                            sizeof(uint32_t));
+    c->xs = (float*)realloc(c->xs, c->samples * sizeof(float));
+    c->ys = (float*)realloc(c->ys, c->samples * sizeof(float));
+    c->ids = (uint32_t*)realloc(c->ids, c->samples * sizeof(uint32_t));
 
-    return vao;
+    for (unsigned i=0; i < c->threads; ++i)
+    {
+        CpuWorker* w = &c->workers[i];
+        w->y0 = (uint64_t)c->height * i / c->threads;
+        w->y1 = (uint64_t)c->height * (i + 1) / c->threads;
+        w->acc = (double (*)[4])realloc(w->acc, c->samples * sizeof(*w->acc));
+    }
+    c->iterations = (seed && cfg->start) ? cfg->start_iter : 0;
 }
 
-Feedback* feedback_new(GLuint samples)
+/*
+ *  Sorts the sites into grid buckets with a counting sort
+ */
+void cpu_grid(Cpu* c)
 {
-    Feedback* f = (Feedback*)calloc(1, sizeof(Feedback));
+    const uint32_t buckets = c->gw * c->gh;
+    memset(c->start, 0, (buckets + 1) * sizeof(uint32_t));
 
-    f->prog = glCreateProgram();
-    GLuint shader = shader_compile(GL_VERTEX_SHADER, feedback_src);
-    glAttachShader(f->prog, shader);
-    const GLchar* varying[] = { "pos" };
-    glTransformFeedbackVaryings(f->prog, 1, varying, GL_INTERLEAVED_ATTRIBS);
-    glLinkProgram(f->prog);
-    program_check(f->prog);
-
-    f->vao = feedback_indices(samples);
+    uint32_t* bucket = (uint32_t*)malloc(c->samples * sizeof(uint32_t));
+    for (uint32_t i=0; i < c->samples; ++i)
+    {
+        uint32_t gx = c->pts[i][0] * c->width / c->cell;
+        uint32_t gy = c->pts[i][1] * c->height / c->cell;
+        gx = (gx < c->gw) ? gx : c->gw - 1;
+        gy = (gy < c->gh) ? gy : c->gh - 1;
+        bucket[i] = gy * c->gw + gx;
+        c->start[bucket[i] + 1]++;
+    }
+    for (uint32_t b=0; b < buckets; ++b)
+    {
+        c->start[b + 1] += c->start[b];
+    }
 
-    return f;
+    uint32_t* fill = (uint32_t*)malloc(buckets * sizeof(uint32_t));
+    memcpy(fill, c->start, buckets * sizeof(uint32_t));
+    for (uint32_t i=0; i < c->samples; ++i)
+    {
+        const uint32_t k = fill[bucket[i]]++;
+        c->xs[k] = c->pts[i][0] * c->width;
+        c->ys[k] = c->pts[i][1] * c->height;
+        c->ids[k] = i;
+    }
+    free(fill);
+    free(bucket);
 }
 
-void feedback_draw(Config* cfg, Voronoi* v, Sum* s, Feedback* f)
+/*
+ *  Runs a single iteration: bucket the sites, accumulate every band in
+ *  parallel, then merge the accumulators and move each point to its
+ *  cell's weighted centroid
+ */
+void cpu_step(Cpu* c)
 {
-    glEnable(GL_RASTERIZER_DISCARD);
-    glBindVertexArray(f->vao);
-    glUseProgram(f->prog);
+    cpu_grid(c);
+    pthread_barrier_wait(&c->go);
+    cpu_band(&c->workers[0]);
+    pthread_barrier_wait(&c->done);
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, s->tex);
-    glUniform1i(glGetUniformLocation(f->prog, "tex"), 0);
-    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, v->pts);
+    double (*acc)[4] = c->workers[0].acc;
+    for (unsigned t=1; t < c->threads; ++t)
+    {
+        const double (*other)[4] = (const double (*)[4])c->workers[t].acc;
+        for (uint32_t i=0; i < c->samples; ++i)
+        {
+            for (unsigned j=0; j < 4; ++j)
+            {
+                acc[i][j] += other[i][j];
+            }
+        }
+    }
 
-    glBeginTransformFeedback(GL_POINTS);
-    glDrawArrays(GL_POINTS, 0, cfg->samples);
-    glEndTransformFeedback();
+    /*  Cells that cover no pixels keep their previous state  */
+    double total = 0;
+    float max = 0;
+    for (uint32_t i=0; i < c->samples; ++i)
+    {
+        if (acc[i][3] > 0)
+        {
+            const float x = acc[i][0] / acc[i][3] / c->width;
+            const float y = acc[i][1] / acc[i][3] / c->height;
+            const float d = hypotf((x - c->pts[i][0]) * c->width,
+                                   (y - c->pts[i][1]) * c->height);
+            c->pts[i][0] = x;
+            c->pts[i][1] = y;
+            c->pts[i][2] = acc[i][3] / acc[i][2];
+            total += d;
+            max = (d > max) ? d : max;
+        }
+    }
+    c->max_delta = max;
+    c->mean_delta = total / c->samples;
+    c->iterations++;
+}
 
-    glDisable(GL_RASTERIZER_DISCARD);
-    teardown(NULL);
+/*
+ *  Counterpart to pipeline_run for the CPU engine (without --pyramid).
+ *  Returns the number of iterations run in total.
+ */
+int cpu_run(const char* label, const Config* cfg, Cpu* c)
+{
+    while ((int64_t)c->iterations < cfg->iter)
+    {
+        fprintf(progress_file(), "\r%s: %u / %i", label, c->iterations + 1,
+                cfg->iter);
+        fflush(progress_file());
+        const double start = span_begin();
+        cpu_step(c);
+        span_end("cpu_step", NULL, start);
+
+        if (telemetry)
+        {
+            double weight = 0;
+            for (uint32_t i=0; i < c->samples; ++i)
+            {
+                weight += c->pts[i][2];
+            }
+            telemetry_stats(label, c->iterations, c->max_delta, c->mean_delta,
+                            weight / c->samples, cfg, NULL);
+        }
+
+        if (cfg->checkpoint && c->iterations % cfg->every == 0)
+        {
+            checkpoint_write(cfg, (const float (*)[3])c->pts, c->iterations);
+        }
+        if (cfg->tolerance && c->max_delta < cfg->tolerance)
+        {
+            fprintf(progress_file(), "\n%s: converged after %u iterations "
+                    "(max displacement %g px, mean %g px)",
+                    label, c->iterations, c->max_delta, c->mean_delta);
+            break;
+        }
+    }
+    fprintf(progress_file(), "\n");
+    return c->iterations;
 }
 
 /******************************************************************************/
@@ -642,6 +4779,10 @@ const char* stipples_vert_src = GLSL(
     {
         vec2 scaled = vec2(pos.x * radius.x, pos.y * radius.y) * sqrt(offset.z);
         gl_Position = vec4(scaled + 2.0f*offset.xy - 1.0f, 0.0f, 1.0f);
+        if (offset.z < 0.0f)
+        {
+            gl_Position = vec4(2.0f, 2.0f, 0.0f, 1.0f);
+        }
     }
 );
 
@@ -658,8 +4799,27 @@ typedef struct Stipples_
 {
     GLuint vao;
     GLuint prog;
+    GLuint segments;
 } Stipples;
 
+/*
+ *  Returns the number of segments in each dot.  As with cones, an n-gon
+ *  is within r * pi^2 / (2 n^2) of the true circle; dots are held to a
+ *  quarter of a pixel at their largest (full weight) size.
+ */
+uint32_t stipples_segments(const Config* c)
+{
+    if (c->resolution)
+    {
+        return c->resolution;
+    }
+    const double r = config_dot_radius(c);
+    const uint32_t n = ceil(M_PI * sqrt(2 * r));
+    return (n < SEGMENTS_MIN) ? SEGMENTS_MIN
+         : (n > SEGMENTS_MAX) ? SEGMENTS_MAX
+         : n;
+}
+
 Stipples* stipples_new(Config* cfg, Voronoi* v)
 {
     Stipples* s = (Stipples*)calloc(1, sizeof(Stipples));
@@ -667,16 +4827,17 @@ Stipples* stipples_new(Config* cfg, Voronoi* v)
     glGenVertexArrays(1, &s->vao);
     glBindVertexArray(s->vao);
 
+    s->segments = stipples_segments(cfg);
     {   // Make and bind a VBO that draws a simple circle
         GLuint vbo;
-        size_t bytes = (2 + cfg->resolution) * 2 * sizeof(float);
+        size_t bytes = (2 + s->segments) * 2 * sizeof(float);
         float* buf = (float*)malloc(bytes);
 
         buf[0] = 0;
         buf[1] = 0;
-        for (size_t i=0; i <= cfg->resolution; ++i)
+        for (size_t i=0; i <= s->segments; ++i)
         {
-            float angle = 2 * M_PI * i / cfg->resolution;
+            float angle = 2 * M_PI * i / s->segments;
             buf[i*2 + 2] = cos(angle);
             buf[i*2 + 3] = sin(angle);
         }
@@ -696,32 +4857,456 @@ Stipples* stipples_new(Config* cfg, Voronoi* v)
     glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
     glVertexAttribDivisor(1, 1);
 
-    s->prog = program_link(
-        shader_compile(GL_VERTEX_SHADER, stipples_vert_src),
-        shader_compile(GL_FRAGMENT_SHADER, stipples_frag_src));
+    s->prog = program_new(stipples_vert_src, stipples_frag_src);
+    glUseProgram(s->prog);
+    glUniform2f(glGetUniformLocation(s->prog, "radius"),
+                cfg->radius * cfg->sx, cfg->radius * cfg->sy);
 
-    teardown(NULL);
+    state_reset();
     return s;
 }
 
 void stipples_draw(Config* cfg, Stipples* s)
 {
-    glUseProgram(s->prog);
+    state_program(s->prog);
+    state_vao(s->vao);
+    glDrawArraysInstanced(GL_TRIANGLE_FAN, 0, s->segments+2, cfg->samples);
+}
 
-    glUniform2f(glGetUniformLocation(s->prog, "radius"),
-                cfg->radius * cfg->sx, cfg->radius * cfg->sy);
-    glBindVertexArray(s->vao);
-    glDrawArraysInstanced(GL_TRIANGLE_FAN, 0, cfg->resolution+2, cfg->samples);
+/******************************************************************************/
 
-    teardown(NULL);
+/*
+ *  Runs cfg->warmup untimed iterations, then cfg->bench timed ones, and
+ *  prints per-stage GPU times and overall throughput to stdout.  Returns
+ *  false if an iteration failed.
+ */
+bool bench_run(Config* cfg, Pipeline* p)
+{
+    if (p->timers)
+    {
+        timers_free(p->timers);
+    }
+    p->timers = timers_new(cfg->bench);
+    for (int i=0; i < cfg->warmup; ++i)
+    {
+        if (!pipeline_step(cfg, p))
+        {
+            return false;
+        }
+    }
+    timers_reset(p->timers);
+
+    glFinish();
+    const double start = wall_time();
+    for (int i=0; i < cfg->bench; ++i)
+    {
+        if (!pipeline_step(cfg, p))
+        {
+            return false;
+        }
+    }
+    glFinish();
+    const double elapsed = wall_time() - start;
+    timers_flush(p->timers);
+
+    /*  Per-iteration totals, then {min, median, p99} for each stage  */
+    Timers* t = p->timers;
+    const unsigned n = t->count;
+    double* total = (double*)calloc(n, sizeof(double));
+    for (unsigned i=0; i < STAGE_COUNT; ++i)
+    {
+        for (unsigned j=0; j < n; ++j)
+        {
+            total[j] += t->ms[i][j];
+        }
+    }
+
+    double stats[STAGE_COUNT + 1][3];
+    for (unsigned i=0; i <= STAGE_COUNT; ++i)
+    {
+        double* ms = (i < STAGE_COUNT) ? t->ms[i] : total;
+        stats[i][0] = percentile(ms, n, 0);
+        stats[i][1] = percentile(ms, n, 50);
+        stats[i][2] = percentile(ms, n, 99);
+    }
+    free(total);
+
+    const double ips = cfg->bench / elapsed;
+    const double mpps = ips * cfg->width * cfg->height / 1e6;
+    const double sum_mb = sum_bytes(p->s) / 1e6;
+
+    if (cfg->bench_format == BENCH_CSV)
+    {
+        printf("image,width,height,samples,voronoi,centroid,iterations");
+        for (unsigned i=0; i <= STAGE_COUNT; ++i)
+        {
+            const char* name = (i < STAGE_COUNT) ? stage_names[i] : "total";
+            printf(",%s_min_ms,%s_median_ms,%s_p99_ms", name, name, name);
+        }
+        printf(",iterations_per_s,mpixels_per_s,sum_format,sum_mb,"
+               "sum_traffic_mb_per_s\n");
+
+        printf("%s,%u,%u,%u,%s,%s,%i", cfg->image, cfg->width, cfg->height,
+               cfg->samples, voronoi_names[cfg->voronoi],
+               centroid_names[cfg->centroid], cfg->bench);
+        for (unsigned i=0; i <= STAGE_COUNT; ++i)
+        {
+            printf(",%.4f,%.4f,%.4f", stats[i][0], stats[i][1], stats[i][2]);
+        }
+        printf(",%.3f,%.3f,%s,%.3f,%.1f\n", ips, mpps,
+               sum_format_names[p->s->format], sum_mb, 2 * sum_mb * ips);
+    }
+    else
+    {
+        printf("{\"image\": \"%s\", \"width\": %u, \"height\": %u, "
+               "\"samples\": %u, \"voronoi\": \"%s\", \"centroid\": \"%s\", "
+               "\"iterations\": %i, \"stages\": {",
+               cfg->image, cfg->width, cfg->height, cfg->samples,
+               voronoi_names[cfg->voronoi], centroid_names[cfg->centroid],
+               cfg->bench);
+        for (unsigned i=0; i <= STAGE_COUNT; ++i)
+        {
+            printf("%s\"%s\": {\"min_ms\": %.4f, \"median_ms\": %.4f, "
+                   "\"p99_ms\": %.4f}", i ? ", " : "",
+                   (i < STAGE_COUNT) ? stage_names[i] : "total",
+                   stats[i][0], stats[i][1], stats[i][2]);
+        }
+        printf("}, \"iterations_per_s\": %.3f, \"mpixels_per_s\": %.3f, "
+               "\"sum_format\": \"%s\", \"sum_mb\": %.3f, "
+               "\"sum_traffic_mb_per_s\": %.1f}\n",
+               ips, mpps, sum_format_names[p->s->format], sum_mb,
+               2 * sum_mb * ips);
+    }
+    return true;
+}
+
+/******************************************************************************/
+
+/*  Share of a 60 Hz frame given to relaxation in interactive mode  */
+#define PACER_BUDGET_MS     12.0
+#define PACER_MAX_STEPS     256
+
+/*  Seconds between updates of the iterations/s counter  */
+#define PACER_REPORT_INTERVAL 0.5
+
+/*
+ *  Runs several relaxation steps per displayed frame in interactive mode.
+ *  With steps set to 0, the count is tuned so that the steps' GPU time
+ *  (measured by double-buffered queries, like Timers) fits the budget.
+ */
+typedef struct Pacer_
+{
+    GLuint queries[2];
+    unsigned query_steps[2];/*  Steps timed by each query  */
+    unsigned frame;
+    bool tune;
+    unsigned steps;         /*  Steps in the next frame  */
+
+    uint64_t iterations;    /*  At the last counter update  */
+    double time;
+} Pacer;
+
+Pacer* pacer_new(const Config* cfg, const Pipeline* p)
+{
+    Pacer* pc = (Pacer*)calloc(1, sizeof(Pacer));
+    glGenQueries(2, pc->queries);
+    pc->tune = !cfg->steps;
+    pc->steps = cfg->steps ? cfg->steps : 1;
+    pc->iterations = p->iterations;
+    pc->time = wall_time();
+    return pc;
+}
+
+/*
+ *  Runs one frame's worth of steps, then retunes the step count from the
+ *  previous frame's GPU time.  Returns false if a step failed.
+ */
+bool pacer_step(Config* cfg, Pipeline* p, Pacer* pc)
+{
+    /*  Time queries can't nest, so when the stages are already being
+     *  timed (for telemetry), the steps collected during this frame stand
+     *  in (each step collects the one before it)  */
+    const bool query = pc->tune && !p->timers;
+    if (query)
+    {
+        glBeginQuery(GL_TIME_ELAPSED, pc->queries[pc->frame % 2]);
+        pc->query_steps[pc->frame % 2] = pc->steps;
+    }
+    bool ok = true;
+    double timed_ms = 0;
+    unsigned timed = 0;
+    for (unsigned i=0; ok && i < pc->steps; ++i)
+    {
+        ok = pipeline_step(cfg, p);
+        if (ok && pc->tune && !query && p->timers->frame > 1)
+        {
+            for (unsigned j=0; j < STAGE_COUNT; ++j)
+            {
+                timed_ms += p->timers->last[j];
+            }
+            timed++;
+        }
+    }
+    if (query)
+    {
+        glEndQuery(GL_TIME_ELAPSED);
+    }
+    if (!pc->tune || !ok)
+    {
+        return ok;
+    }
+
+    /*  The query read back is the previous frame's, so its time is
+     *  split between the steps it timed, not the ones just run  */
+    if (pc->frame++ > 0 && (query || timed))
+    {
+        double ms = timed ? timed_ms / timed : 0;
+        if (query)
+        {
+            const unsigned slot = pc->frame % 2;
+            GLuint64 ns;
+            glGetQueryObjectui64v(pc->queries[slot], GL_QUERY_RESULT, &ns);
+            ms = ns / 1e6 / pc->query_steps[slot];
+        }
+
+        /*  Grow at most twofold per frame, so one fast frame (e.g. right
+         *  after a resize) can't push the next far over budget  */
+        const double per_step = fmax(ms, 1e-3);
+        const double fit = floor(PACER_BUDGET_MS / per_step);
+        const double steps = fmin(fit, 2.0 * pc->steps);
+        pc->steps = (steps < 1) ? 1
+                  : (steps > PACER_MAX_STEPS) ? PACER_MAX_STEPS
+                  : (unsigned)steps;
+    }
+    return true;
+}
+
+/*
+ *  Shows the relaxation rate in the window title every so often
+ */
+void pacer_report(const Pipeline* p, Pacer* pc, GLFWwindow* window)
+{
+    const double now = wall_time();
+    if (now - pc->time < PACER_REPORT_INTERVAL)
+    {
+        return;
+    }
+
+    char title[128];
+    snprintf(title, sizeof(title),
+             "swingline: %llu iterations, %.0f iterations/s, %u per frame",
+             (unsigned long long)p->iterations,
+             (p->iterations - pc->iterations) / (now - pc->time), pc->steps);
+    glfwSetWindowTitle(window, title);
+
+    pc->iterations = p->iterations;
+    pc->time = now;
 }
 
 /******************************************************************************/
 
-void print_usage(char* prog)
+void print_usage(char* prog)
+{
+    fprintf(stderr, "Usage: %s [-n samples] [-r radius] [-o output] "
+                              "[-i iterations] image\n"
+                    "       %s --batch manifest -i iterations [options]\n",
+                    prog, prog);
+    fprintf(stderr, "Options:\n"
+        "  --centroid scatter|rows   centroid engine (default: scatter)\n"
+        "  --sum-format rgba32f|rgba16f\n"
+        "                            storage for partial sums; rgba16f\n"
+        "                            halves the rows engine's Sum texture\n"
+        "                            but keeps only 11 bits, so it's limited\n"
+        "                            to images up to 2048 pixels wide and\n"
+        "                            can bias centroids by up to a pixel\n"
+        "                            (default: rgba32f)\n"
+        "  --voronoi cones|jfa       Voronoi engine (default: cones)\n"
+        "  --cones fan|quad          cone geometry for --voronoi cones\n"
+        "                            (default: fan)\n"
+        "  --segments N              segments per cone and dot (default:\n"
+        "                            picked from the cell and dot sizes)\n"
+        "  --gamma g                 place points by darkness to the power\n"
+        "                            g; above 1 adds contrast (default: 1)\n"
+        "  --invert                  place points by brightness instead\n"
+        "                            of darkness\n"
+        "  --cpu                     run on the CPU, without OpenGL\n"
+        "                            (--voronoi and --centroid are ignored)\n"
+        "  --threads N               threads for the CPU engine and for\n"
+        "                            seeding (default: one per core)\n"
+        "  --seed N                  random seed for the initial points\n"
+        "                            (default: 1)\n"
+        "  --max-size N              shrink images so neither side is\n"
+        "                            longer than N pixels\n"
+        "  --prefetch N              images decoded ahead of the GPU in\n"
+        "                            --batch mode (default: 2)\n"
+        "  --steps N                 relaxation steps per displayed frame\n"
+        "                            in interactive mode (default: as many\n"
+        "                            as fit in a frame)\n"
+        "  --no-vsync                draw interactive frames without\n"
+        "                            waiting for the display\n"
+        "  --shader-cache dir        keep linked shader programs in dir\n"
+        "                            (default: $XDG_CACHE_HOME/swingline)\n"
+        "  --no-shader-cache         compile shaders on every run\n"
+        "  --devices N               share --batch jobs between N GPUs,\n"
+        "                            or 0 for every one found (default: 1)\n"
+        "  --tolerance px            stop once points move less than px\n"
+        "                            (-i becomes an upper bound)\n"
+        "  --batch manifest          stipple every 'input output' line of\n"
+        "                            manifest (- for stdin) in one process\n"
+        "  --adaptive N              split and remove points as they relax,\n"
+        "                            aiming for the ink of one full-size\n"
+        "                            dot per cell; -n gives the starting\n"
+        "                            count and N the most points allowed\n"
+        "  --sequence N              treat the --batch manifest as frames of\n"
+        "                            an animation: each frame starts from\n"
+        "                            the last one's points and runs N\n"
+        "                            iterations (the first runs -i)\n"
+        "  --bench N                 time N iterations per stage and print\n"
+        "                            the results instead of running -i\n"
+        "  --warmup N                untimed iterations before --bench\n"
+        "                            (default: 10)\n"
+        "  --bench-format csv|json   format for --bench results\n"
+        "  --precision N             decimal places in output (default: 2)\n"
+        "  --metrics file            write GPU stage times, point movement\n"
+        "                            and spans as JSON lines to file\n"
+        "                            (- for stdout)\n"
+        "  --trace file              write spans and counters to file in\n"
+        "                            Chrome's trace event format\n"
+        "  --format svg|csv|bin      output format (default: from the\n"
+        "                            extension: .svg, .csv or .bin)\n"
+        "  --checkpoint file         save the points to file (in .bin\n"
+        "                            format) while running\n"
+        "  --every N                 iterations between checkpoints\n"
+        "                            (default: 100)\n"
+        "  --pyramid L               relax at L resolutions, halving the\n"
+        "                            image size at each coarser level\n"
+        "  --tile N                  render N x N pixel tiles, streaming\n"
+        "                            the image from disk, for images too\n"
+        "                            large for one texture\n"
+        "  --resume file             start from the points in a .bin file\n"
+        "                            instead of random ones; iterations it\n"
+        "                            records count towards -i\n"
+        "Outputs ending in .svgz or .gz are gzip-compressed.\n");
+}
+
+/*
+ *  Checks that an output file name has a supported extension
+ */
+bool output_check(OutputFormat format, const char* out)
+{
+    const Config cfg = {.format = format};
+    if (output_format(&cfg, out) == OUTPUT_AUTO)
+    {
+        fprintf(stderr, "Error: output file should end in .svg, .svgz, .csv, "
+                        ".csv.gz or .bin, or be given a --format (%s)\n", out);
+        return false;
+    }
+    return true;
+}
+
+/*
+ *  Returns a copy of an 8-bit image resampled to w x h (no larger than the
+ *  original), averaging the source pixels under each output pixel
+ */
+stbi_uc* image_resize(const stbi_uc* img, uint32_t width, uint32_t height,
+                      uint32_t w, uint32_t h)
+{
+    stbi_uc* out = (stbi_uc*)malloc((size_t)w * h);
+    for (uint32_t y=0; y < h; ++y)
+    {
+        const uint32_t y0 = (uint64_t)y * height / h;
+        const uint32_t y1 = (uint64_t)(y + 1) * height / h;
+        for (uint32_t x=0; x < w; ++x)
+        {
+            const uint32_t x0 = (uint64_t)x * width / w;
+            const uint32_t x1 = (uint64_t)(x + 1) * width / w;
+            uint32_t sum = 0;
+            for (uint32_t j=y0; j < y1; ++j)
+            {
+                for (uint32_t i=x0; i < x1; ++i)
+                {
+                    sum += img[(size_t)j*width + i];
+                }
+            }
+            const uint32_t n = (x1 - x0) * (y1 - y0);
+            out[(size_t)y*w + x] = (sum + n/2) / n;
+        }
+    }
+    return out;
+}
+
+/*
+ *  Loads an image as 8-bit grayscale into c->img, setting its size and
+ *  aspect ratio, and shrinking it to fit within c->max_size if set.
+ *  Prints an error and returns false on failure.  This is safe to call
+ *  from several threads at once.
+ */
+bool image_load(const char* filename, Config* c)
+{
+    c->image = filename;
+    if (c->tile)
+    {
+        c->source = tile_source_open(filename);
+        if (!c->source)
+        {
+            return false;
+        }
+        c->width = c->source->width;
+        c->height = c->source->height;
+        config_set_aspect_ratio(c);
+        return true;
+    }
+
+    int x, y;
+    const double start = span_begin();
+    stbi_set_flip_vertically_on_load_thread(true);
+    stbi_uc* img = stbi_load(filename, &x, &y, NULL, 1);
+
+    if (img == NULL)
+    {
+        fprintf(stderr, "Error loading image %s: %s\n",
+                filename, stbi_failure_reason());
+        return false;
+    }
+
+    const int longest = (x > y) ? x : y;
+    if (c->max_size && (uint32_t)longest > c->max_size)
+    {
+        const int w = fmax(1, round((double)x * c->max_size / longest));
+        const int h = fmax(1, round((double)y * c->max_size / longest));
+        stbi_uc* small = image_resize(img, x, y, w, h);
+        stbi_image_free(img);
+        img = small;
+        x = w;
+        y = h;
+    }
+    span_end("image_load", filename, start);
+
+    c->img = img;
+    c->width = (uint32_t)x;
+    c->height = (uint32_t)y;
+    config_set_aspect_ratio(c);
+    return true;
+}
+
+/*
+ *  Releases the image loaded by image_load
+ */
+void image_free(Config* c)
+{
+    if (c->source)
+    {
+        tile_source_close(c->source);
+        c->source = NULL;
+    }
+    free(c->img);     /*  stb_image allocates with malloc  */
+    c->img = NULL;
+}
+
+void* image_load_thread(void* data)
 {
-    fprintf(stderr, "Usage: %s [-n samples] [-r radius] [-o output] "
-                              "[-i iterations] image\n", prog);
+    Config* c = (Config*)data;
+    return image_load(c->image, c) ? c : NULL;
 }
 
 Config* parse_args(int argc, char** argv)
@@ -730,23 +5315,271 @@ Config* parse_args(int argc, char** argv)
     float r = 0.01f;
     int iter = -1;
     const char* out = NULL;
+    CentroidEngine centroid = CENTROID_SCATTER;
+    SumFormat sum_format = SUM_RGBA32F;
+    VoronoiEngine voronoi = VORONOI_CONES;
+    float tolerance = 0.0f;
+    const char* batch = NULL;
+    int bench = 0;
+    int warmup = 10;
+    BenchFormat bench_format = BENCH_CSV;
+    int precision = 2;
+    OutputFormat format = OUTPUT_AUTO;
+    const char* checkpoint = NULL;
+    int every = 100;
+    const char* resume = NULL;
+    bool n_set = false;
+    int pyramid = 1;
+    int tile = 0;
+    int segments = 0;
+    bool cpu = false;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t seed = 1;
+    int max_size = 0;
+    int prefetch = 2;
+    int sequence = 0;
+    int devices = 1;
+    int steps = 0;
+    bool vsync = true;
+    char* shader_cache = NULL;
+    float gamma = 1.0f;
+    const char* metrics = NULL;
+    const char* trace = NULL;
+    bool invert = false;
+    bool shader_cache_set = false;
+    uint32_t adaptive = 0;
+    ConeShape cone = CONE_FAN;
+
+    enum { OPT_CENTROID = 256, OPT_VORONOI, OPT_TOLERANCE, OPT_BATCH,
+           OPT_BENCH, OPT_WARMUP, OPT_BENCH_FORMAT, OPT_PRECISION,
+           OPT_FORMAT, OPT_CHECKPOINT, OPT_EVERY, OPT_RESUME,
+           OPT_PYRAMID, OPT_TILE, OPT_CONES, OPT_SEGMENTS,
+           OPT_CPU, OPT_THREADS, OPT_SEED, OPT_MAX_SIZE, OPT_PREFETCH,
+           OPT_SEQUENCE, OPT_ADAPTIVE, OPT_DEVICES,
+           OPT_STEPS, OPT_NO_VSYNC, OPT_SHADER_CACHE,
+           OPT_NO_SHADER_CACHE, OPT_GAMMA, OPT_INVERT,
+           OPT_SUM_FORMAT, OPT_METRICS, OPT_TRACE };
+    const struct option longopts[] = {
+        {"centroid", required_argument, NULL, OPT_CENTROID},
+        {"sum-format", required_argument, NULL, OPT_SUM_FORMAT},
+        {"voronoi", required_argument, NULL, OPT_VORONOI},
+        {"tolerance", required_argument, NULL, OPT_TOLERANCE},
+        {"batch", required_argument, NULL, OPT_BATCH},
+        {"bench", required_argument, NULL, OPT_BENCH},
+        {"warmup", required_argument, NULL, OPT_WARMUP},
+        {"bench-format", required_argument, NULL, OPT_BENCH_FORMAT},
+        {"precision", required_argument, NULL, OPT_PRECISION},
+        {"format", required_argument, NULL, OPT_FORMAT},
+        {"checkpoint", required_argument, NULL, OPT_CHECKPOINT},
+        {"every", required_argument, NULL, OPT_EVERY},
+        {"resume", required_argument, NULL, OPT_RESUME},
+        {"pyramid", required_argument, NULL, OPT_PYRAMID},
+        {"tile", required_argument, NULL, OPT_TILE},
+        {"cones", required_argument, NULL, OPT_CONES},
+        {"segments", required_argument, NULL, OPT_SEGMENTS},
+        {"cpu", no_argument, NULL, OPT_CPU},
+        {"threads", required_argument, NULL, OPT_THREADS},
+        {"seed", required_argument, NULL, OPT_SEED},
+        {"max-size", required_argument, NULL, OPT_MAX_SIZE},
+        {"prefetch", required_argument, NULL, OPT_PREFETCH},
+        {"sequence", required_argument, NULL, OPT_SEQUENCE},
+        {"adaptive", required_argument, NULL, OPT_ADAPTIVE},
+        {"devices", required_argument, NULL, OPT_DEVICES},
+        {"steps", required_argument, NULL, OPT_STEPS},
+        {"no-vsync", no_argument, NULL, OPT_NO_VSYNC},
+        {"shader-cache", required_argument, NULL, OPT_SHADER_CACHE},
+        {"no-shader-cache", no_argument, NULL, OPT_NO_SHADER_CACHE},
+        {"gamma", required_argument, NULL, OPT_GAMMA},
+        {"invert", no_argument, NULL, OPT_INVERT},
+        {"metrics", required_argument, NULL, OPT_METRICS},
+        {"trace", required_argument, NULL, OPT_TRACE},
+        {NULL, 0, NULL, 0}};
 
     while (true)
     {
-        char c = getopt(argc, argv, "r:n:o:i:");
+        int c = getopt_long(argc, argv, "r:n:o:i:", longopts, NULL);
         if (c == -1) {  break; }
 
         switch (c)
         {
+            case OPT_CENTROID:
+                if (!strcmp(optarg, "scatter"))     centroid = CENTROID_SCATTER;
+                else if (!strcmp(optarg, "rows"))   centroid = CENTROID_ROWS;
+                else
+                {
+                    fprintf(stderr, "Error: unknown centroid engine '%s'\n",
+                            optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_SUM_FORMAT:
+                if (!strcmp(optarg, "rgba32f"))      sum_format = SUM_RGBA32F;
+                else if (!strcmp(optarg, "rgba16f")) sum_format = SUM_RGBA16F;
+                else
+                {
+                    fprintf(stderr, "Error: unknown Sum format '%s'\n",
+                            optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_VORONOI:
+                if (!strcmp(optarg, "cones"))       voronoi = VORONOI_CONES;
+                else if (!strcmp(optarg, "jfa"))    voronoi = VORONOI_JFA;
+                else
+                {
+                    fprintf(stderr, "Error: unknown Voronoi engine '%s'\n",
+                            optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_TOLERANCE:
+                tolerance = atof(optarg);
+                break;
+            case OPT_BATCH:
+                batch = optarg;
+                break;
+            case OPT_BENCH:
+                bench = atoi(optarg);
+                break;
+            case OPT_WARMUP:
+                warmup = atoi(optarg);
+                break;
+            case OPT_BENCH_FORMAT:
+                if (!strcmp(optarg, "csv"))         bench_format = BENCH_CSV;
+                else if (!strcmp(optarg, "json"))   bench_format = BENCH_JSON;
+                else
+                {
+                    fprintf(stderr, "Error: unknown benchmark format '%s'\n",
+                            optarg);
+                    exit(-1);
+                }
+                break;
             case 'n':
                 n = atoi(optarg);
+                n_set = true;
+                break;
+            case OPT_CHECKPOINT:
+                checkpoint = optarg;
+                break;
+            case OPT_EVERY:
+                every = atoi(optarg);
+                break;
+            case OPT_RESUME:
+                resume = optarg;
+                break;
+            case OPT_PYRAMID:
+                pyramid = atoi(optarg);
+                break;
+            case OPT_TILE:
+                tile = atoi(optarg);
+                break;
+            case OPT_CONES:
+                if (!strcmp(optarg, "fan"))         cone = CONE_FAN;
+                else if (!strcmp(optarg, "quad"))   cone = CONE_QUAD;
+                else
+                {
+                    fprintf(stderr, "Error: unknown cone shape '%s'\n",
+                            optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_CPU:
+                cpu = true;
+                break;
+            case OPT_THREADS:
+                threads = atoi(optarg);
+                if (threads <= 0)
+                {
+                    fprintf(stderr, "Error: invalid thread count (%s)\n",
+                            optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_MAX_SIZE:
+                max_size = atoi(optarg);
+                break;
+            case OPT_PREFETCH:
+                prefetch = atoi(optarg);
+                break;
+            case OPT_SEQUENCE:
+                sequence = atoi(optarg);
+                break;
+            case OPT_ADAPTIVE:
+                adaptive = atoi(optarg);
+                break;
+            case OPT_DEVICES:
+                devices = atoi(optarg);
+                break;
+            case OPT_STEPS:
+                steps = atoi(optarg);
+                break;
+            case OPT_NO_VSYNC:
+                vsync = false;
+                break;
+            case OPT_SHADER_CACHE:
+                shader_cache = optarg;
+                shader_cache_set = true;
+                break;
+            case OPT_NO_SHADER_CACHE:
+                shader_cache = NULL;
+                shader_cache_set = true;
+                break;
+            case OPT_GAMMA:
+                gamma = atof(optarg);
+                break;
+            case OPT_INVERT:
+                invert = true;
+                break;
+            case OPT_METRICS:
+                metrics = optarg;
+                break;
+            case OPT_TRACE:
+                trace = optarg;
+                break;
+            case OPT_SEED:
+                seed = strtoull(optarg, NULL, 0);
+                break;
+            case OPT_SEGMENTS:
+                segments = atoi(optarg);
+                if (segments < 3)
+                {
+                    fprintf(stderr, "Error: need at least 3 segments (%s)\n",
+                            optarg);
+                    exit(-1);
+                }
                 break;
             case 'i':
                 iter = atoi(optarg);
+                if (iter < -1)
+                {
+                    fprintf(stderr, "Error: invalid iteration count (%s)\n",
+                            optarg);
+                    exit(-1);
+                }
                 break;
             case 'o':
                 out = optarg;
                 break;
+            case OPT_FORMAT:
+                if (!strcmp(optarg, "svg"))         format = OUTPUT_SVG;
+                else if (!strcmp(optarg, "csv"))    format = OUTPUT_CSV;
+                else if (!strcmp(optarg, "bin"))    format = OUTPUT_BIN;
+                else
+                {
+                    fprintf(stderr, "Error: unknown output format '%s'\n",
+                            optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_PRECISION:
+                precision = atoi(optarg);
+                if (precision < 0 || precision > WRITER_MAX_PRECISION)
+                {
+                    fprintf(stderr, "Error: precision must be between 0 and "
+                                    "%i (%s)\n", WRITER_MAX_PRECISION, optarg);
+                    exit(-1);
+                }
+                break;
             case 'r':
                 r = 0.01f * atof(optarg);
                 break;
@@ -756,97 +5589,662 @@ Config* parse_args(int argc, char** argv)
         };
     }
 
-    if (optind >= argc)
+    if (!batch && optind >= argc)
     {
         fprintf(stderr, "%s: expected filename after options\n", argv[0]);
         print_usage(argv[0]);
         exit(EXIT_FAILURE);
     }
-    else if (n > UINT16_MAX)
+    else if (batch && (optind < argc || out))
     {
-        fprintf(stderr, "Error: too many points (%i)\n", n);
+        fprintf(stderr, "Error: --batch takes inputs and outputs from the "
+                        "manifest, not the command line\n");
         exit(-1);
     }
-
-    int x, y;
-    stbi_set_flip_vertically_on_load(true);
-    stbi_uc* img = stbi_load(argv[optind], &x, &y, NULL, 1);
-
-    if (img == NULL)
+    else if (batch && iter == -1)
+    {
+        fprintf(stderr, "Error: --batch requires an iteration count (-i)\n");
+        exit(-1);
+    }
+    else if (bench < 0 || warmup < 0)
+    {
+        fprintf(stderr, "Error: iteration counts must be positive\n");
+        exit(-1);
+    }
+    else if (bench && (batch || iter != -1 || tolerance))
+    {
+        fprintf(stderr, "Error: --bench can't be combined with --batch, "
+                        "-i or --tolerance\n");
+        exit(-1);
+    }
+    else if (tolerance < 0.0f)
+    {
+        fprintf(stderr, "Error: tolerance must be positive (%g)\n", tolerance);
+        exit(-1);
+    }
+    else if (tolerance > 0.0f && iter == -1)
+    {
+        fprintf(stderr, "Error: --tolerance requires an iteration limit "
+                        "(-i)\n");
+        exit(-1);
+    }
+    else if (batch && (checkpoint || resume))
+    {
+        fprintf(stderr, "Error: --checkpoint and --resume can't be used "
+                        "with --batch\n");
+        exit(-1);
+    }
+    else if (checkpoint && (iter == -1 || bench))
+    {
+        fprintf(stderr, "Error: --checkpoint requires an iteration count "
+                        "(-i)\n");
+        exit(-1);
+    }
+    else if (pyramid < 1 || pyramid > PYRAMID_MAX_LEVELS)
+    {
+        fprintf(stderr, "Error: pyramid levels must be between 1 and %i (%i)\n",
+                PYRAMID_MAX_LEVELS, pyramid);
+        exit(-1);
+    }
+    else if (pyramid > 1 && (iter == -1 || bench || resume))
     {
-        fprintf(stderr, "Error loading image: %s\n", stbi_failure_reason());
+        fprintf(stderr, "Error: --pyramid requires an iteration count (-i) "
+                        "and can't be used with --bench or --resume\n");
         exit(-1);
     }
-    else if ((unsigned)x > UINT16_MAX || (unsigned)y > UINT16_MAX)
+    else if (tile < 0)
+    {
+        fprintf(stderr, "Error: tile size must be positive (%i)\n", tile);
+        exit(-1);
+    }
+    else if (tile && (iter == -1 || bench || pyramid > 1 ||
+                      centroid != CENTROID_SCATTER))
+    {
+        fprintf(stderr, "Error: --tile requires an iteration count (-i) and "
+                        "the scatter centroid engine, and can't be used with "
+                        "--bench or --pyramid\n");
+        exit(-1);
+    }
+    else if (cpu && (iter == -1 || bench || pyramid > 1 || tile))
+    {
+        fprintf(stderr, "Error: --cpu requires an iteration count (-i) and "
+                        "can't be used with --bench, --pyramid or --tile\n");
+        exit(-1);
+    }
+    else if (sequence < 0)
+    {
+        fprintf(stderr, "Error: --sequence iterations must be positive (%i)\n",
+                sequence);
+        exit(-1);
+    }
+    else if (sequence && (!batch || pyramid > 1))
+    {
+        fprintf(stderr, "Error: --sequence requires --batch and can't be "
+                        "used with --pyramid\n");
+        exit(-1);
+    }
+    else if (sum_format == SUM_RGBA16F && (cpu || centroid != CENTROID_ROWS))
+    {
+        fprintf(stderr, "Error: --sum-format rgba16f requires --centroid "
+                        "rows, whose per-row partials fit in half floats\n");
+        exit(-1);
+    }
+    else if (!(gamma > 0.0f) || isinf(gamma))
+    {
+        fprintf(stderr, "Error: --gamma must be positive\n");
+        exit(-1);
+    }
+    else if (steps < 0 || steps > PACER_MAX_STEPS)
+    {
+        fprintf(stderr, "Error: --steps must be between 0 and %i\n",
+                PACER_MAX_STEPS);
+        exit(-1);
+    }
+    else if (devices < 0 || devices > EGL_MAX_DEVICES)
+    {
+        fprintf(stderr, "Error: --devices must be between 0 and %i\n",
+                EGL_MAX_DEVICES);
+        exit(-1);
+    }
+    else if (devices != 1 && (!batch || cpu || sequence))
+    {
+        fprintf(stderr, "Error: --devices requires --batch and can't be "
+                        "used with --cpu or --sequence\n");
+        exit(-1);
+    }
+    else if (adaptive && (adaptive < n || adaptive > VORONOI_MAX_SAMPLES))
+    {
+        fprintf(stderr, "Error: --adaptive capacity must be between -n (%u) "
+                        "and %u\n", n, VORONOI_MAX_SAMPLES);
+        exit(-1);
+    }
+    else if (adaptive && (cpu || tile || pyramid > 1 || checkpoint || resume))
+    {
+        fprintf(stderr, "Error: --adaptive can't be used with --cpu, --tile, "
+                        "--pyramid, --checkpoint or --resume\n");
+        exit(-1);
+    }
+    else if (max_size < 0 || prefetch < 1)
+    {
+        fprintf(stderr, "Error: --max-size must be positive and --prefetch "
+                        "at least 1\n");
+        exit(-1);
+    }
+    else if (max_size && tile)
+    {
+        fprintf(stderr, "Error: --max-size can't be used with --tile\n");
+        exit(-1);
+    }
+    else if (every <= 0)
+    {
+        fprintf(stderr, "Error: checkpoint interval must be positive (%i)\n",
+                every);
+        exit(-1);
+    }
+    else if (n == 0 || n > VORONOI_MAX_SAMPLES)
+    {
+        fprintf(stderr, "Error: invalid number of points (%u, limit is %u)\n",
+                n, VORONOI_MAX_SAMPLES);
+        exit(-1);
+    }
+
+    if (out && !output_check(format, out))
     {
-        fprintf(stderr, "Error: image is too large (%i x %i)\n", x, y);
         exit(-1);
     }
 
-    if (out)
+    /*  A resumed run takes its sample count from the point file  */
+    PointsHeader header = {.iterations = 0};
+    float (*start)[3] = NULL;
+    if (resume)
     {
-        size_t len = strlen(out);
-        if (len >= 4 && strcmp(out + len - 4, ".svg"))
+        start = points_read(resume, &header);
+        if (!start)
+        {
+            exit(-1);
+        }
+        else if (n_set && n != header.samples)
         {
-            fprintf(stderr, "Error: output file should end in .svg (%s)\n", out);
+            fprintf(stderr, "Error: %s holds %u points, not %u\n",
+                    resume, header.samples, n);
             exit(-1);
         }
+        n = header.samples;
     }
 
     Config* c = (Config*)calloc(1, sizeof(Config));
     (*c) = (Config){
-        .img = img,
-        .width = (uint16_t)x,
-        .height = (uint16_t)y,
-        .samples = (uint16_t)n,
-        .resolution = 256,
+        .samples = adaptive ? adaptive : n,
+        .seeds = n,
+        .adaptive = adaptive != 0,
+        .resolution = segments,
+        .cone = cone,
         .radius = r,
+        .gamma = gamma,
+        .invert = invert,
+        .centroid = centroid,
+        .sum_format = sum_format,
+        .voronoi = voronoi,
         .iter = iter,
-        .out = out};
+        .tolerance = tolerance,
+        .out = out,
+        .precision = precision,
+        .format = format,
+        .batch = batch,
+        .start = start,
+        .start_iter = header.iterations,
+        .checkpoint = checkpoint,
+        .every = every,
+        .pyramid = pyramid,
+        .tile = tile,
+        .cpu = cpu,
+        .threads = (threads > 0) ? threads : 1,
+        .seed = seed,
+        .max_size = max_size,
+        .prefetch = prefetch,
+        .sequence = sequence,
+        .devices = devices,
+        .steps = steps,
+        .vsync = vsync,
+        .shader_cache = shader_cache,
+        .metrics = metrics,
+        .trace = trace,
+        .bench = bench,
+        .warmup = warmup,
+        .bench_format = bench_format};
+
+    /*  Benchmarks never open a window  */
+    if (bench)
+    {
+        c->iter = warmup + bench;
+    }
 
-    config_set_aspect_ratio(c);
+    /*  Programs are cached in the user's cache directory by default  */
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    if (!shader_cache_set && ((xdg && *xdg) || home))
+    {
+        const char* base = (xdg && *xdg) ? xdg : home;
+        c->shader_cache = (char*)malloc(strlen(base) + 32);
+        sprintf(c->shader_cache, "%s%s/swingline", base,
+                (xdg && *xdg) ? "" : "/.cache");
+    }
+
+    /*  The image is loaded by main, possibly in the background  */
+    if (!batch)
+    {
+        c->image = argv[optind];
+    }
     return c;
 }
 
+/*
+ *  In --batch mode, images are decoded by worker threads while the GPUs
+ *  relax earlier ones.  Jobs sit in a ring of cfg->prefetch slots; each
+ *  device takes the oldest decoded job whenever it runs out of work, so
+ *  faster devices take more of them.  A worker stalls when the ring is
+ *  full, so at most that many images are held in memory.
+ */
+typedef struct {
+    char input[2048];
+    char output[2048];
+    Config job;
+    bool ok;        /*  The image was loaded into job  */
+    bool ready;     /*  A worker has finished with this slot  */
+    bool busy;      /*  Claimed, and not yet finished by a device  */
+} BatchSlot;
+
+typedef struct {
+    FILE* manifest;
+    const Config* cfg;
+
+    BatchSlot* slots;
+    unsigned capacity;
+    unsigned next;      /*  Jobs claimed from the manifest  */
+    unsigned taken;     /*  Jobs claimed by devices         */
+    unsigned devices;   /*  Devices still taking jobs       */
+    bool eof;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+} BatchQueue;
+
+void* batch_worker(void* data)
+{
+    BatchQueue* q = (BatchQueue*)data;
+    pthread_mutex_lock(&q->lock);
+    while (true)
+    {
+        while (!q->eof && q->slots[q->next % q->capacity].busy)
+        {
+            pthread_cond_wait(&q->space, &q->lock);
+        }
+
+        /*  Lines are read under the lock so that jobs are claimed in order  */
+        char line[4096];
+        if (q->eof || !fgets(line, sizeof(line), q->manifest))
+        {
+            q->eof = true;
+            pthread_cond_broadcast(&q->ready);
+            pthread_cond_broadcast(&q->space);
+            break;
+        }
+
+        char* start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || *start == '\0')
+        {
+            continue;
+        }
+
+        BatchSlot* slot = &q->slots[q->next++ % q->capacity];
+        slot->ok = false;
+        slot->ready = false;
+        slot->busy = true;
+        if (sscanf(start, "%2047s %2047s", slot->input, slot->output) != 2)
+        {
+            fprintf(stderr, "Error: malformed manifest line '%s'\n", start);
+            slot->ready = true;
+            pthread_cond_broadcast(&q->ready);
+            continue;
+        }
+        slot->job = *q->cfg;
+        pthread_mutex_unlock(&q->lock);
+
+        slot->job.out = slot->output;
+        slot->ok = output_check(q->cfg->format, slot->output) &&
+                   image_load(slot->input, &slot->job);
+
+        pthread_mutex_lock(&q->lock);
+        slot->ready = true;
+        pthread_cond_broadcast(&q->ready);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+/*
+ *  One consumer of the batch queue, with its own context and pipeline
+ *  (or CPU engine), and its own tallies
+ */
+typedef struct {
+    BatchQueue* q;
+    Config* cfg;
+    int device;     /*  EGL device, or -1 for the default context  */
+
+    int done;
+    int failed;
+    uint64_t iterations;
+    double seconds; /*  Time spent on jobs  */
+} BatchDevice;
+
+/*
+ *  Called by a device whose context couldn't be created.  Returns true if
+ *  it should stop taking jobs, leaving them to the other devices; the
+ *  last device left keeps going (failing each job), so that the workers
+ *  can finish the manifest.
+ */
+bool batch_leave(BatchQueue* q, const BatchDevice* d)
+{
+    fprintf(stderr, "Error: couldn't create a context on EGL device %i\n",
+            d->device);
+    pthread_mutex_lock(&q->lock);
+    const bool last = q->devices == 1;
+    q->devices -= !last;
+    pthread_mutex_unlock(&q->lock);
+    return !last;
+}
+
+void* batch_device(void* data)
+{
+    BatchDevice* d = (BatchDevice*)data;
+    BatchQueue* q = d->q;
+    Config* c = d->cfg;
+
+    Context* ctx = NULL;
+    Pipeline* p = NULL;
+    Cpu* cpu = NULL;
+    bool started = false;   /*  Points exist to warm-start a frame from */
+
+    /*  EGL devices don't need a job's size for their context, so they
+     *  make it before taking a job that another device could run  */
+    if (!c->cpu && d->device >= 0 && !(ctx = device_context(d->device)) &&
+        batch_leave(q, d))
+    {
+        return NULL;
+    }
+
+    while (true)
+    {
+        pthread_mutex_lock(&q->lock);
+        const unsigned i = q->taken++;
+        BatchSlot* slot = &q->slots[i % q->capacity];
+        while (!(i < q->next && slot->ready) && !(q->eof && i >= q->next))
+        {
+            pthread_cond_wait(&q->ready, &q->lock);
+        }
+        const bool finished = i >= q->next;
+        pthread_mutex_unlock(&q->lock);
+        if (finished)
+        {
+            break;
+        }
+
+        /*  In --sequence mode, frames after the first carry on from the
+         *  previous frame's points for a few more iterations  */
+        Config* job = &slot->job;
+        const char* input = slot->input;
+        const bool seed = !c->sequence || !started;
+        if (!seed)
+        {
+            job->iter = c->sequence;
+        }
+
+        const double start = wall_time();
+        bool ok = slot->ok;
+        if (!ok)
+        {
+            /*  Nothing was loaded  */
+        }
+        else if (c->cpu)
+        {
+            cpu = cpu ? cpu : cpu_new(c->threads);
+            cpu_load(job, cpu, seed);
+            started = true;
+            cpu_run(input, job, cpu);
+            d->iterations += cpu->iterations;
+            ok = points_save(job, (const float (*)[3])cpu->pts,
+                             cpu->iterations);
+        }
+        else
+        {
+            /*  The context and every program outlive the individual jobs.
+             *  The default context is sized for the first job's image, in
+             *  case it falls back to a hidden GLFW window.  */
+            if (!ctx && d->device < 0)
+            {
+                ctx = make_context(job->width, job->height, true);
+            }
+            if (ctx && !p)
+            {
+                p = pipeline_new(job);
+                pthread_mutex_lock(&q->lock);
+                c->centroid = job->centroid;
+                pthread_mutex_unlock(&q->lock);
+            }
+
+            ok = ctx && pipeline_load(job, p, seed);
+            if (ok)
+            {
+                started = true;
+                ok = pipeline_run(input, job, p);
+                d->iterations += p->iterations;
+                ok = ok && pipeline_save(job, p);
+            }
+        }
+        d->seconds += wall_time() - start;
+        d->done += ok;
+        d->failed += !ok;
+        if (slot->ok)
+        {
+            image_free(job);
+        }
+
+        pthread_mutex_lock(&q->lock);
+        slot->busy = false;
+        pthread_cond_broadcast(&q->space);
+        pthread_mutex_unlock(&q->lock);
+    }
+    return NULL;
+}
+
+/*
+ *  Runs every line of the batch manifest through one context and
+ *  pipeline per device.  Each line holds an input image and an output
+ *  file name, separated by whitespace; blank lines and lines starting
+ *  with # are skipped.  Returns the number of jobs that failed.
+ */
+int batch_run(const char* prog, Config* c)
+{
+    FILE* manifest = strcmp(c->batch, "-") ? fopen(c->batch, "r") : stdin;
+    if (!manifest)
+    {
+        perror("Failed to open batch manifest");
+        return 1;
+    }
+
+    /*  A single device uses the default context, as other modes do  */
+    unsigned devices = c->cpu ? 1 : c->devices;
+    if (devices != 1)
+    {
+        const unsigned found = egl_device_count();
+        if (devices > found)
+        {
+            fprintf(stderr, "Warning: %u EGL devices requested, but %u found\n",
+                    devices, found);
+        }
+        devices = (devices && devices < found) ? devices : found;
+        devices = devices ? devices : 1;
+    }
+
+    BatchQueue q = {
+        .manifest = manifest,
+        .cfg = c,
+        .slots = (BatchSlot*)calloc(c->prefetch, sizeof(BatchSlot)),
+        .capacity = c->prefetch,
+        .devices = devices,
+    };
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.ready, NULL);
+    pthread_cond_init(&q.space, NULL);
+
+    const unsigned workers = (c->threads < c->prefetch) ? c->threads
+                                                        : c->prefetch;
+    pthread_t* ids = (pthread_t*)calloc(workers + devices, sizeof(pthread_t));
+    for (unsigned i=0; i < workers; ++i)
+    {
+        pthread_create(&ids[i], NULL, batch_worker, &q);
+    }
+
+    /*  The first device runs on this thread, since a GLFW fallback
+     *  window must be created on the main thread  */
+    BatchDevice* ds = (BatchDevice*)calloc(devices, sizeof(BatchDevice));
+    for (unsigned i=0; i < devices; ++i)
+    {
+        ds[i] = (BatchDevice){
+            .q = &q, .cfg = c, .device = (devices > 1) ? (int)i : -1};
+    }
+    for (unsigned i=1; i < devices; ++i)
+    {
+        pthread_create(&ids[workers + i], NULL, batch_device, &ds[i]);
+    }
+    batch_device(&ds[0]);
+
+    int done = 0;
+    int failed = 0;
+    for (unsigned i=0; i < devices; ++i)
+    {
+        if (i)
+        {
+            pthread_join(ids[workers + i], NULL);
+        }
+        done += ds[i].done;
+        failed += ds[i].failed;
+    }
+    for (unsigned i=0; i < workers; ++i)
+    {
+        pthread_join(ids[i], NULL);
+    }
+
+    if (devices > 1)
+    {
+        for (unsigned i=0; i < devices; ++i)
+        {
+            const BatchDevice* d = &ds[i];
+            const double t = d->seconds > 0 ? d->seconds : 1;
+            fprintf(stderr, "%s: device %i: %i images in %.1f s "
+                            "(%.2f images/s, %.1f iterations/s)\n",
+                    prog, d->device, d->done + d->failed, d->seconds,
+                    d->done / t, d->iterations / t);
+        }
+    }
+
+    free(ds);
+    free(ids);
+    free(q.slots);
+    pthread_mutex_destroy(&q.lock);
+    pthread_cond_destroy(&q.ready);
+    pthread_cond_destroy(&q.space);
+
+    if (manifest != stdin)
+    {
+        fclose(manifest);
+    }
+    fprintf(stderr, "%s: %i images stippled, %i failed\n",
+            prog, done, failed);
+    return failed;
+}
+
 int main(int argc, char** argv)
 {
     Config* c = parse_args(argc, argv);
-    GLFWwindow* win = make_context(c->width, c->height, c->iter != -1);
+    program_cache = c->shader_cache;
+    telemetry_open(c->metrics, c->trace);
+    if (c->batch)
+    {
+        return batch_run(argv[0], c) ? EXIT_FAILURE : 0;
+    }
 
-    /*  These are the three stages in the stipple update loop   */
-    Voronoi* v = voronoi_new(c, c->img);
-    Sum* s = sum_new(c);
-    Feedback* f = feedback_new(c->samples);
+    /*  A headless run decodes the image while the context starts up;
+     *  interactive mode needs the image size to open its window  */
+    pthread_t decoder;
+    const bool overlap = !c->cpu && c->iter != -1;
+    if (overlap)
+    {
+        pthread_create(&decoder, NULL, image_load_thread, c);
+    }
+    else if (!image_load(c->image, c))
+    {
+        return EXIT_FAILURE;
+    }
 
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-    glClearDepth(1.0f);
+    if (c->cpu)
+    {
+        Cpu* cpu = cpu_new(c->threads);
+        cpu_load(c, cpu, true);
+        cpu_run(argv[0], c, cpu);
+        if (c->out && !points_save(c, (const float (*)[3])cpu->pts,
+                                   cpu->iterations))
+        {
+            return EXIT_FAILURE;
+        }
+        return 0;
+    }
+
+    Context* ctx = make_context(overlap ? 1 : c->width,
+                                overlap ? 1 : c->height, overlap);
+    Pipeline* p = pipeline_new(c);
+    void* loaded = c;
+    if (overlap)
+    {
+        pthread_join(decoder, &loaded);
+    }
+    if (!loaded || !pipeline_load(c, p, true))
+    {
+        return EXIT_FAILURE;
+    }
+    Voronoi* v = p->v;
 
     if (c->iter == -1)  /* Interactive mode */
     {
         /*  These are used for rendering to the screen  */
         GLuint quad_vao = quad_new();
-        GLuint blit_program = program_link(
-            shader_compile(GL_VERTEX_SHADER, quad_vert_src),
-            shader_compile(GL_FRAGMENT_SHADER, blit_frag_src));
+        GLuint blit_program = program_new(quad_vert_src, blit_frag_src);
+        glUseProgram(blit_program);
+        glUniform1i(glGetUniformLocation(blit_program, "tex"), 0);
         Stipples* stipples = stipples_new(c, v);
+        Pacer* pacer = pacer_new(c, p);
+        glfwSwapInterval(c->vsync);
 
-        while (!glfwWindowShouldClose(win))
+        while (!glfwWindowShouldClose(ctx->window))
         {
-            /*  Render the current voronoi diagram's state to v->tex */
-            voronoi_draw(c, v);
-
-            /*  Calculate the centroids and write them to v->pts  */
-            sum_draw(c, v, s);
-            feedback_draw(c, v, s, f);
+            if (!pacer_step(c, p, pacer))
+            {
+                return EXIT_FAILURE;
+            }
+            pacer_report(p, pacer, ctx->window);
 
             /*  Then draw the quad   */
-            glBindVertexArray(quad_vao);
-            glUseProgram(blit_program);
+            int width, height;
+            glfwGetFramebufferSize(ctx->window, &width, &height);
+            state_framebuffer(0, width, height);
+            state_depth_test(false);
+            state_blend(0);
+            state_vao(quad_vao);
+            state_program(blit_program);
             glActiveTexture(GL_TEXTURE0);
             glBindTexture(GL_TEXTURE_2D, v->tex);
-            glUniform1i(glGetUniformLocation(blit_program, "tex"), 0);
 
-            glDisable(GL_DEPTH_TEST);
             glClear(GL_COLOR_BUFFER_BIT);
 
             glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
@@ -855,55 +6253,28 @@ int main(int argc, char** argv)
             stipples_draw(c, stipples);
 
             /*  Draw and poll   */
-            glfwSwapBuffers(win);
+            glfwSwapBuffers(ctx->window);
             glfwPollEvents();
         }
     }
-    else    /* Non-interactive mode */
+    else if (c->bench)
     {
-        for (int i=0; i < c->iter; ++i)
+        if (!bench_run(c, p))
         {
-            printf("\r%s: %i / %i", argv[0], i + 1, c->iter);
-            fflush(stdout);
-            voronoi_draw(c, v);
-            sum_draw(c, v, s);
-            feedback_draw(c, v, s, f);
+            return EXIT_FAILURE;
         }
-        printf("\n");
     }
-
-    if (c->out)
+    else    /* Non-interactive mode */
     {
-        FILE* f = fopen(c->out, "w");
-        if (!f)
+        if (!pipeline_run(argv[0], c, p))
         {
-            perror("File opening failed");
             return EXIT_FAILURE;
         }
+    }
 
-        fprintf(f,
-            "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\"?>\n"
-            "<svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\"\n"
-            "    viewBox=\"0 0 %u %u\" width=\"%u\" height=\"%u\" id=\"swingline\">\n",
-            c->width, c->height, c->width, c->height);
-
-        glBindBuffer(GL_ARRAY_BUFFER, v->pts);
-        size_t bytes = 3 * sizeof(float) * c->samples;
-        float (*pts)[3] = (float (*)[3])malloc(3 * sizeof(bytes) * c->samples);
-        glGetBufferSubData(GL_ARRAY_BUFFER, 0, bytes, pts);
-
-        for (int i=0; i < c->samples; ++i)
-        {
-            fprintf(f,
-                "    <circle cx=\"%f\" cy=\"%f\" r=\"%f\" fill=\"black\" />\n",
-                c->width*pts[i][0], c->height - c->height*pts[i][1],
-                c->radius * fmin(c->sx, c->sy) * fmin(c->width, c->height) *
-                    pts[i][2]);
-        }
-
-        free(pts);
-        fprintf(f, "</svg>");
-        fclose(f);
+    if (c->out && !pipeline_save(c, p))
+    {
+        return EXIT_FAILURE;
     }
 
     return 0;